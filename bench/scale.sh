@@ -0,0 +1,126 @@
+#!/bin/sh
+#
+# scale.sh - how many concurrent passh sessions can one host sustain?
+#
+# Usage: bench/scale.sh [-m idle|stream] [-i <seconds>] [<N>]...
+#
+# For each <N> (default: 10 100 1000) start <N> passh sessions against
+# bench/fake-ssh, wait for all of them to log in, then sample /proc for
+# <seconds> (default: 5) and print one line:
+#
+#   N         sessions
+#   mode      idle or stream
+#   rss_kb    average VmRSS of a passh process
+#   fds       average number of open fds of a passh process
+#   cpu_pct   CPU used by all the passh processes (100 = one core)
+#   csw_s     context switches per second, all passh processes
+#   wake_s    voluntary context switches (wakeups) per second, all
+#   login_ms  p50/p90/p99/max from starting passh to the password read
+#
+# Linux only (/proc). 10000 sessions need `ulimit -u' and pty limits
+# (/proc/sys/kernel/pty/max) to be raised.
+#
+
+mode=idle
+interval=5
+
+while getopts m:i: opt; do
+    case $opt in
+        m) mode=$OPTARG ;;
+        i) interval=$OPTARG ;;
+        *) sed -n '4p' "$0" | sed 's/^# //'; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 0 ] && set -- 10 100 1000
+
+cd "$(dirname "$0")/.." || exit 1
+passh=$PWD/passh
+fake=$PWD/bench/fake-ssh
+[ -x "$passh" ] || { echo "!! build passh first" >&2; exit 1; }
+
+PASSH_BENCH_DIR=$(mktemp -d) || exit 1
+export PASSH_BENCH_DIR
+trap 'cleanup; rm -rf "$PASSH_BENCH_DIR"' EXIT
+trap 'exit 1' INT TERM
+
+cleanup()
+{
+    for f in "$PASSH_BENCH_DIR"/start.*; do
+        [ -e "$f" ] && kill "${f##*.}" 2>/dev/null
+    done
+    rm -f "$PASSH_BENCH_DIR"/start.* "$PASSH_BENCH_DIR"/login.*
+    sleep 1
+}
+
+# pid utime+stime voluntary nonvoluntary rss_kb fds, for all sessions
+sample()
+{
+    for f in "$PASSH_BENCH_DIR"/start.*; do
+        pid=${f##*.}
+        [ -r /proc/$pid/stat ] || continue
+        fds=$(ls /proc/$pid/fd 2>/dev/null | wc -l)
+        awk -v pid=$pid -v fds=$fds '
+            FILENAME ~ /stat$/ { sub(/.*\) /, ""); ticks = $12 + $13 }
+            /^voluntary_ctxt_switches/ { vol = $2 }
+            /^nonvoluntary_ctxt_switches/ { nonvol = $2 }
+            /^VmRSS/ { rss = $2 }
+            END { print pid, ticks, vol, nonvol, rss, fds }
+        ' /proc/$pid/stat /proc/$pid/status 2>/dev/null
+    done
+}
+
+echo "# passh $(git rev-parse --short HEAD 2>/dev/null || echo '?'), $(uname -sr), $(nproc 2>/dev/null || echo '?') cpus, $(date '+%Y-%m-%d %H:%M')"
+printf '%-6s %-6s %8s %5s %8s %9s %9s %s\n' \
+    N mode rss_kb fds cpu_pct csw_s wake_s login_ms_p50/p90/p99/max
+
+for n in "$@"; do
+    i=0
+    while [ $i -lt $n ]; do
+        sh -c 'date +%s%N > "$PASSH_BENCH_DIR/start.$$";
+               exec "$0" -p password "$1" "$2"' \
+            "$passh" "$fake" "$mode" < /dev/null > /dev/null 2>&1 &
+        i=$((i + 1))
+    done
+
+    # wait for the logins
+    tries=0
+    while [ $(ls "$PASSH_BENCH_DIR" | grep -c '^login\.') -lt $n ] && [ $tries -lt 600 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+
+    sample > "$PASSH_BENCH_DIR/s1"
+    sleep "$interval"
+    sample > "$PASSH_BENCH_DIR/s2"
+
+    login=$(for f in "$PASSH_BENCH_DIR"/login.*; do
+                [ -e "$f" ] || continue
+                pid=${f##*.}
+                echo $(( ($(cat "$f") - $(cat "$PASSH_BENCH_DIR/start.$pid")) / 1000000 ))
+            done | sort -n | awk '
+                { v[NR] = $1 }
+                END {
+                    if (NR == 0) { print "-"; exit }
+                    printf "%d/%d/%d/%d%s", v[int((NR - 1) * .5) + 1],
+                        v[int((NR - 1) * .9) + 1], v[int((NR - 1) * .99) + 1],
+                        v[NR], NR < n ? " (" NR " logged in)" : ""
+                }' n=$n)
+
+    awk -v n=$n -v mode=$mode -v interval=$interval -v login="$login" \
+        -v hz=$(getconf CLK_TCK) '
+        NR == FNR { t[$1] = $2; v[$1] = $3; nv[$1] = $4; next }
+        $1 in t {
+            ++procs; rss += $5; fds += $6
+            ticks += $2 - t[$1]; vol += $3 - v[$1]; csw += $3 - v[$1] + $4 - nv[$1]
+        }
+        END {
+            if (procs == 0) procs = 1
+            printf "%-6d %-6s %8d %5.1f %8.1f %9.1f %9.1f %s\n", n, mode,
+                rss / procs, fds / procs, ticks / hz / interval * 100,
+                csw / interval, vol / interval, login
+        }
+    ' "$PASSH_BENCH_DIR/s1" "$PASSH_BENCH_DIR/s2"
+
+    cleanup
+done
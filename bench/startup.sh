@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# startup.sh - what does it cost to start passh?
+#
+# Usage: bench/startup.sh [-n <runs>]
+#
+# Run /bin/true <runs> (default: 1000) times directly and through passh, with
+# the default patterns and with all of them given (-i -P -E -S -y), and print
+# the average wall time of one run in microseconds. The differences between
+# the lines are passh's own startup (and exit) and the pattern compiling.
+#
+
+runs=1000
+
+while getopts n: opt; do
+    case $opt in
+        n) runs=$OPTARG ;;
+        *) sed -n '5p' "$0" | sed 's/^# //'; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+cd "$(dirname "$0")/.." || exit 1
+passh=$PWD/passh
+[ -x "$passh" ] || { echo "!! build passh first" >&2; exit 1; }
+# not the shell builtin
+for t in /bin/true /usr/bin/true; do
+    [ -x $t ] && break
+done
+
+# <label> <command>...
+run()
+{
+    label=$1
+    shift
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt $runs ]; do
+        "$@" < /dev/null > /dev/null 2>&1
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    printf '%-10s %8d\n' "$label" $(( (end - start) / runs / 1000 ))
+}
+
+echo "# passh $(git rev-parse --short HEAD 2>/dev/null || echo '?'), $(uname -sr), $runs runs, $(date '+%Y-%m-%d %H:%M')"
+printf '%-10s %8s\n' run us
+
+run true     $t
+run passh    "$passh" -p password $t
+run patterns "$passh" -p password -i -y \
+    -P '\(password\|passphrase\|PIN\)[^:]*: *$' \
+    -E 'Connection \(refused\|timed out\|closed\)\|No route to host' \
+    -S '[$#>] *$' $t
@@ -48,6 +48,13 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdint.h>
 
 #define BUFFSIZE         (8 * 1024)
 #define DEFAULT_COUNT    0
@@ -56,40 +63,240 @@
 #define DEFAULT_PROMPT   "[Pp]assword: \\{0,1\\}$"
 #define DEFAULT_YESNO    "(yes/no)? \\{0,1\\}$"
 
+#define EXEC_MAX_INFLIGHT  256          /* `-x': commands */
+#define EXEC_MAX_PENDING   (16 * 1024)  /* `-x': bytes not yet written to the pty */
+#define EXEC_MAX_MARKER    64
+#define EXEC_LOGIN_WAIT    (5 * 1000)   /* ms, `-x': quiet without a prompt */
+
+#define SHARE_RING         (64 * 1024)  /* `-s': output kept for the viewers */
+#define SHARE_MAX_VIEWERS  64
+
+/* `-g': longer lines are split. A single write() of up to PIPE_BUF bytes to a
+ * pipe is atomic. */
+#if defined(PIPE_BUF) && PIPE_BUF > 512
+#define TAG_LINE_MAX       PIPE_BUF
+#else
+#define TAG_LINE_MAX       512
+#endif
+
 #define ERROR_GENERAL    (200 + 1)
 #define ERROR_USAGE      (200 + 2)
 #define ERROR_TIMEOUT    (200 + 3)
 #define ERROR_SYS        (200 + 4)
 #define ERROR_MAX_TRIES  (200 + 5)
+#define ERROR_TIMEOUT_FIRST   (200 + 6)
+#define ERROR_TIMEOUT_PROMPT  (200 + 7)
+#define ERROR_TIMEOUT_AUTH    (200 + 8)
+#define ERROR_TIMEOUT_IDLE    (200 + 9)
+#define ERROR_TIMEOUT_TOTAL   (200 + 10)
+#define ERROR_RETRIES    (200 + 11)
+
+/* `-a': for the askpass, i.e. passh run by ssh */
+#define ASKPASS_SOCKET_ENV  "PASSH_ASKPASS_SOCKET"
+#define ASKPASS_TOKEN_ENV   "PASSH_ASKPASS_TOKEN"
+
+#define BINARY_WAIT      1000           /* ms, `-B': for the password reader */
+
+#define DEFAULT_RETRY_DELAY  500        /* ms, `-r' */
+#define MAX_RETRY_DELAY      (30 * 1000)
+#define KILL_WAIT            1000       /* ms, SIGTERM -> SIGKILL (`-r') */
+
+/*
+ * Per-phase deadlines (see `-d'). All times are in milliseconds and measured
+ * with a monotonic clock so they are not affected by NTP steps.
+ */
+enum {
+    PHASE_FIRST,    /* start -> first output from the child */
+    PHASE_PROMPT,   /* start -> first password prompt */
+    PHASE_AUTH,     /* password sent -> first non-blank output after it */
+    PHASE_IDLE,     /* no output from the child for this long */
+    PHASE_TOTAL,    /* the whole session */
+    PHASE_MAX
+};
+
+static const struct {
+    const char *name;
+    int rcode;
+    const char *msg;
+} phases[PHASE_MAX] = {
+    { "first",  ERROR_TIMEOUT_FIRST,  "timeout waiting for first output" },
+    { "prompt", ERROR_TIMEOUT_PROMPT, "timeout waiting for password prompt" },
+    { "auth",   ERROR_TIMEOUT_AUTH,   "timeout waiting for output after password" },
+    { "idle",   ERROR_TIMEOUT_IDLE,   "timeout waiting for output (idle)" },
+    { "total",  ERROR_TIMEOUT_TOTAL,  "session timeout" },
+};
+
+/*
+ * `-m': the session's state is published in <dir>/passh.<pid> which is
+ * mmap()ed so `passh-top' can read it without bothering us. It's updated
+ * seqlock-style: `seq' is odd while an update is in progress and a reader
+ * retries if `seq' is odd or has changed while it was copying the data.
+ */
+#define STAT_MAGIC       0x50415348  /* "PASH" */
+#define STAT_VERSION     2
+
+enum {
+    STAT_START,     /* no output from the child yet */
+    STAT_RUNNING,   /* got output but no password prompt yet */
+    STAT_AUTH,      /* password sent, waiting for output */
+    STAT_SESSION,   /* got output after the password */
+};
+
+static const char *stat_names[] = {
+    "start", "running", "auth", "session",
+};
+
+struct passh_stat {
+    uint32_t magic;
+    uint32_t version;
+    volatile uint32_t seq;
+    uint32_t phase;
+    int32_t pid;
+    int32_t child_pid;
+    int32_t passwords_seen;
+    int32_t attempts;
+    uint64_t bytes_in;          /* read from the pty */
+    uint64_t bytes_out;         /* written to the pty */
+    int64_t start_ms;           /* now_ms() */
+    int64_t last_activity_ms;   /* now_ms() */
+    char command[128];
+};
+
+#if defined(__GNUC__)
+#define mem_barrier()  __sync_synchronize()
+#else
+#define mem_barrier()  do { } while (0)
+#endif
 
 static struct {
     char *progname;
+    pid_t pid;                  /* not a child's */
     bool reset_on_exit;
     struct termios save_termios;
     bool SIGCHLDed;
     bool received_winch;
     bool stdin_is_tty;
-    bool now_interactive;
+    bool pty_binary;
 
     int fd_ptym;
+    pid_t child_pid;
+    int attempts;               /* `-r': children spawned */
+    int bg_fd;                  /* `-f': to the foreground passh */
 
+    struct passh_stat *stat;
+    char *stat_file;
+
+    /* `-g' */
+    struct {
+        char line[TAG_LINE_MAX];
+        int nline;
+    } tag;
+
+    /* `-k', `-K' */
+    struct {
+        char *head;
+        size_t nhead;
+        char *tail;                 /* ring buffer */
+        size_t ntail;               /* bytes in it */
+        size_t pos;                 /* where the next byte goes */
+        unsigned long long total;
+        bool dumped;
+    } capture;
+
+    /* `-x' */
+    struct {
+        enum { EXEC_LOGIN, EXEC_HANDSHAKE, EXEC_READY } state;
+        int out;                    /* where the frames go */
+        bool eof;
+        char marker[16];            /* "\036" + nonce */
+        /* scanner */
+        bool inside;
+        bool skip_nl;
+        long cur;
+        char hold[EXEC_MAX_MARKER];
+        int nhold;
+        /* commands */
+        char line[BUFFSIZE];
+        int nline;
+        long seq;
+        long done_seq;
+        bool exit_sent;
+        /* not yet written to the pty */
+        char pend[EXEC_MAX_PENDING + 4 * BUFFSIZE + 256];
+        int npend;
+    } exec;
+
+    /* `-s' */
+    struct {
+        int fd;                     /* listening, -1 if not sharing */
+        pid_t pid;                  /* who removes the socket */
+        char ring[SHARE_RING];
+        unsigned long long head;    /* bytes ever put in the ring */
+        struct {
+            int fd;
+            unsigned long long pos; /* the next byte to send */
+        } viewers[SHARE_MAX_VIEWERS];
+        int nviewers;
+        int controller;             /* `-w': fd of the viewer or -1 */
+    } share;
+
+    /* `-q': stdin not yet written to the pty */
+    struct {
+        char buf[4 * BUFFSIZE];
+        int n;
+        bool prompted;              /* the shell is waiting for a line */
+        bool eof;
+    } held;
+
+    /* `-a' */
     struct {
+        int fd;                     /* listening */
+        pid_t pid;                  /* who removes the socket */
+        char dir[sizeof(((struct sockaddr_un *) 0)->sun_path) - 5];
+        char *path;
+        char *link;                 /* passh-askpass we've made, or NULL */
+        char token[33];
+        int passwords_seen;
+    } askpass;
+
+    struct {
+        bool askpass;
         bool ignore_case;
         bool nohup_child;
         bool fatal_no_prompt;
         bool auto_yesno;
+        bool binary;
         char *password;
         char *passwd_prompt;
         char *yesno_prompt;
+        char *success_prompt;
+        char *failure_prompt;
+        char *shell_prompt;
         regex_t re_prompt;
         regex_t re_yesno;
-        int timeout;
+        regex_t re_success;
+        regex_t re_failure;
+        regex_t re_shell;
+        int retries;
+        long retry_delay;       /* ms */
+        long timeout;           /* ms */
+        long deadline[PHASE_MAX];   /* ms, 0 means no deadline */
         int tries;
         bool fatal_more_tries;
         char **command;
 
         char *log_to_pty;
         char *log_from_pty;
+        char *stat_dir;
+        int exec_fd;
+        char *tag;
+        bool tag_time;
+        bool background;
+        int ready_fd;
+        size_t capture_head;
+        size_t capture_tail;
+        char *share_path;
+        bool share_control;
     } opt;
 } g;
 
@@ -98,21 +305,58 @@ usage(int exitcode)
 {
     printf("Usage: %s [OPTION]... COMMAND...\n"
            "\n"
+           "  -a              Answer ssh's prompts as its SSH_ASKPASS program instead\n"
+           "                  of relaying the session through a pty (OpenSSH 8.4+)\n"
+           "  -B              Switch the pty to 8-bit clean raw mode after login and\n"
+           "                  relay stdin even if it's not a tty. The child must poll\n"
+           "                  before reading (ssh does) to see EOF\n"
            "  -c <N>          Send at most <N> passwords (0 means infinite. Default: %d)\n"
            "  -C              Exit if prompted for the <N+1>th password\n"
+           "  -d <phase>:<timeout>\n"
+           "                  Exit if <phase> takes longer than <timeout> seconds\n"
+           "                  (fractions allowed, e.g. `first:0.5'). <phase> is one of\n"
+           "                  `first', `prompt', `auth', `idle' or `total'\n"
+           "  -E <pattern>    Regexp (BRE) for the output telling the connection failed\n"
+           "                  (before any password prompt; see `-r')\n"
+           "  -f              Go to background after login (see `-S')\n"
+           "  -g <label>      Prefix each line of output with <label>\n"
+           "  -G              Also prefix each line with the time (with `-g')\n"
            "  -h              Help\n"
+           "  -k <bytes>      Keep only the last <bytes> of output and print them (and\n"
+           "                  the exit status) when the child exits\n"
+           "  -K <bytes>      Also keep the first <bytes> of output (with `-k')\n"
            "  -i              Case insensitive for password prompt matching\n"
            "  -n              Nohup the child (e.g. used for `ssh -f')\n"
+           "  -N <fd>         Write a newline to <fd> after login (see `-S')\n"
            "  -p <password>   The password (Default: `" DEFAULT_PASSWD "')\n"
            "  -p env:<var>    Read password from env var\n"
            "  -p file:<file>  Read password from file\n"
            "  -P <prompt>     Regexp (BRE) for the password prompt\n"
            "                  (Default: `" DEFAULT_PROMPT "')\n"
+           "  -q <pattern>    Regexp (BRE) for the shell prompt. Hold stdin (even if\n"
+           "                  it's not a tty) and send one line of it each time the\n"
+           "                  shell prompts\n"
+           "  -r <N>[:<delay>]\n"
+           "                  Rerun the command up to <N> times if it exits with non-zero\n"
+           "                  or prints the `-E' pattern before the password prompt.\n"
+           "                  Wait <delay> seconds (Default: 0.5) before the 1st retry,\n"
+           "                  doubled for each next one, with random jitter\n"
+           "  -s <socket>     Let others watch the session by connecting to the unix\n"
+           "                  socket <socket> (e.g. `socat - UNIX-CONNECT:<socket>')\n"
+           "  -S <pattern>    Regexp (BRE) for the output telling the login succeeded.\n"
+           "                  Also if the child exits with 0 after a password was sent\n"
+           "                  (e.g. `ssh -f'). Needed by `-x' and `-B' if there's no\n"
+           "                  password prompt (e.g. key auth)\n"
            "  -l <file>       Save data written to the pty\n"
            "  -L <file>       Save data read from the pty\n"
-           "  -t <timeout>    Timeout waiting for next password prompt\n"
+           "  -m <dir>        Publish the session's state in <dir> for `passh-top'\n"
+           "  -t <timeout>    Timeout (seconds, fractions allowed) waiting for next\n"
+           "                  password prompt\n"
            "                  (0 means no timeout. Default: %d)\n"
            "  -T              Exit if timed out waiting for password prompt\n"
+           "  -w              Also accept input from the first viewer (with `-s')\n"
+           "  -x <fd>         After login read shell commands from <fd>, run them in\n"
+           "                  the remote shell and print their framed output\n"
            "  -y              Auto answer `(yes/no)?' questions\n"
 #if 0
            "  -Y <pattern>    Regexp (BRE) for the `yes/no' prompt\n"
@@ -125,6 +369,9 @@ usage(int exitcode)
     exit(exitcode);
 }
 
+void capture_dump(int rcode);
+void tag_flush(int fd);
+
 void
 fatal(int rcode, const char *fmt, ...)
 {
@@ -135,6 +382,22 @@ fatal(int rcode, const char *fmt, ...)
     vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
 
+    /*
+     * A child which has not exec()ed (e.g. the command's not found). The
+     * atexit handlers, `-k' and `-g' are the parent's business.
+     */
+    if (g.pid != 0 && getpid() != g.pid) {
+        fprintf(stderr, "!! %s\r\n", buf);
+        _exit(rcode);
+    }
+
+    /* `-k': the output so far, which is what we'd want to see */
+    capture_dump(rcode);
+    /* `-g': the last line without a newline */
+    if (g.opt.tag != NULL) {
+        tag_flush(STDOUT_FILENO);
+    }
+
     /* in case stdout and stderr are the same */
     fflush(stdout);
 
@@ -167,7 +430,83 @@ startup()
     g.opt.yesno_prompt = DEFAULT_YESNO;
     g.opt.password = DEFAULT_PASSWD;
     g.opt.tries = DEFAULT_COUNT;
-    g.opt.timeout = DEFAULT_TIMEOUT;
+    g.opt.timeout = DEFAULT_TIMEOUT * 1000;
+    g.opt.exec_fd = -1;
+    g.opt.ready_fd = -1;
+    g.opt.retry_delay = DEFAULT_RETRY_DELAY;
+    g.pid = getpid();
+    g.bg_fd = -1;
+    g.share.fd = -1;
+    g.share.controller = -1;
+}
+
+/*
+ * Milliseconds from a monotonic clock. Only differences are meaningful.
+ */
+long long
+now_ms()
+{
+    struct timeval tv;
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+#endif
+    /* no monotonic clock */
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void
+sleep_ms(long ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = ms % 1000 * 1000000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        ;
+    }
+}
+
+/*
+ * "1", "0.25" (seconds) -> milliseconds
+ */
+long
+arg2ms(const char *arg, char opt)
+{
+    char *end;
+    double sec;
+
+    errno = 0;
+    sec = strtod(arg, &end);
+    if (errno != 0 || end == arg || *end != '\0' || sec < 0 || sec > 1e9) {
+        fatal(ERROR_USAGE, "Error: invalid timeout for '-%c': %s", opt, arg);
+    }
+    return (long) (sec * 1000 + 0.5);
+}
+
+/*
+ * <phase>:<seconds>
+ */
+void
+arg2deadline(const char *arg)
+{
+    const char *colon = strchr(arg, ':');
+    int i;
+
+    if (colon != NULL) {
+        for (i = 0; i < PHASE_MAX; ++i) {
+            if (strlen(phases[i].name) == colon - arg
+                && strncmp(phases[i].name, arg, colon - arg) == 0) {
+                g.opt.deadline[i] = arg2ms(colon + 1, 'd');
+                return;
+            }
+        }
+    }
+    fatal(ERROR_USAGE, "Error: invalid deadline for '-d': %s", arg);
 }
 
 char *
@@ -220,14 +559,43 @@ getargs(int argc, char **argv)
      * POSIXLY_CORRECT is set, then option processing stops as soon as a
      * nonoption argument is encountered.
      */
-    while ((ch = getopt(argc, argv, "+:c:Chil:L:np:P:t:Ty")) != -1) {
+    while ((ch = getopt(argc, argv, "+:aBc:Cd:E:fg:Ghik:K:l:L:m:nN:p:P:q:r:s:S:t:Twx:y")) != -1) {
         switch (ch) {
+            case 'a':
+                g.opt.askpass = true;
+                break;
+
+            case 'B':
+                g.opt.binary = true;
+                break;
+
             case 'c':
                 g.opt.tries = atoi(optarg);
                 break;
             case 'C':
                 g.opt.fatal_more_tries = true;
                 break;
+
+            case 'd':
+                arg2deadline(optarg);
+                break;
+
+            case 'E':
+                g.opt.failure_prompt = optarg;
+                break;
+
+            case 'f':
+                g.opt.background = true;
+                break;
+
+            case 'g':
+                g.opt.tag = optarg;
+                break;
+
+            case 'G':
+                g.opt.tag_time = true;
+                break;
+
             case 'h':
                 usage(0);
 
@@ -235,6 +603,23 @@ getargs(int argc, char **argv)
                 g.opt.ignore_case = true;
                 break;
 
+            case 'k':
+            case 'K':
+                do {
+                    char *end;
+                    long n = strtol(optarg, &end, 10);
+
+                    if (end == optarg || *end != '\0' || n <= 0) {
+                        fatal(ERROR_USAGE, "Error: invalid size for '-%c': %s", ch, optarg);
+                    }
+                    if (ch == 'k') {
+                        g.opt.capture_tail = n;
+                    } else {
+                        g.opt.capture_head = n;
+                    }
+                } while (0);
+                break;
+
             case 'l':
                 g.opt.log_to_pty = optarg;
                 break;
@@ -243,10 +628,23 @@ getargs(int argc, char **argv)
                 g.opt.log_from_pty = optarg;
                 break;
 
+            case 'm':
+                g.opt.stat_dir = optarg;
+                break;
+
             case 'n':
                 g.opt.nohup_child = true;
                 break;
 
+            case 'N':
+                g.opt.ready_fd = atoi(optarg);
+                if (g.opt.ready_fd < 0 || fcntl(g.opt.ready_fd, F_GETFD) < 0) {
+                    fatal(ERROR_USAGE, "Error: bad file descriptor for '-N': %s", optarg);
+                }
+                /* not for the child */
+                fcntl(g.opt.ready_fd, F_SETFD, FD_CLOEXEC);
+                break;
+
             case 'p':
                 g.opt.password = arg2pass(optarg);
                 for (i = 0; i < strlen(optarg); ++i) {
@@ -261,14 +659,63 @@ getargs(int argc, char **argv)
                 g.opt.passwd_prompt = optarg;
                 break;
 
+            case 'q':
+                g.opt.shell_prompt = optarg;
+                break;
+
+            case 'r':
+                do {
+                    char *end;
+                    long n = strtol(optarg, &end, 10);
+
+                    if (end == optarg || (*end != '\0' && *end != ':')
+                        || n < 0 || n > INT_MAX) {
+                        fatal(ERROR_USAGE, "Error: invalid count for '-r': %s", optarg);
+                    }
+                    g.opt.retries = n;
+                    if (*end == ':') {
+                        g.opt.retry_delay = arg2ms(end + 1, 'r');
+                    }
+                } while (0);
+                break;
+
+            case 's':
+                g.opt.share_path = optarg;
+                break;
+
+            case 'S':
+                g.opt.success_prompt = optarg;
+                break;
+
             case 't':
-                g.opt.timeout = atoi(optarg);
+                g.opt.timeout = arg2ms(optarg, 't');
                 break;
 
             case 'T':
                 g.opt.fatal_no_prompt = true;
                 break;
 
+            case 'w':
+                g.opt.share_control = true;
+                break;
+
+            case 'x':
+                g.opt.exec_fd = atoi(optarg);
+                if (g.opt.exec_fd < 0 || fcntl(g.opt.exec_fd, F_GETFD) < 0) {
+                    fatal(ERROR_USAGE, "Error: bad file descriptor for '-x': %s", optarg);
+                }
+                /* the commands must not be mangled or echoed */
+                g.opt.binary = true;
+                g.exec.out = STDOUT_FILENO;
+                do {
+                    struct stat sb;
+
+                    if (fstat(g.opt.exec_fd, &sb) == 0 && S_ISSOCK(sb.st_mode) ) {
+                        g.exec.out = g.opt.exec_fd;
+                    }
+                } while (0);
+                break;
+
             case 'y':
                 g.opt.auto_yesno = true;
                 break;
@@ -306,9 +753,66 @@ getargs(int argc, char **argv)
         fatal(ERROR_USAGE, "Error: invalid RE for password prompt");
     }
     /* (yes/no)? */
-    r = regcomp(&g.opt.re_yesno, g.opt.yesno_prompt, reflag);
-    if (r != 0) {
-        fatal(ERROR_USAGE, "Error: invalid RE for yes/no prompt");
+    if (g.opt.auto_yesno) {
+        r = regcomp(&g.opt.re_yesno, g.opt.yesno_prompt, reflag);
+        if (r != 0) {
+            fatal(ERROR_USAGE, "Error: invalid RE for yes/no prompt");
+        }
+    }
+    /* these need the pty relay */
+    if (g.opt.askpass) {
+        bool relay = g.opt.binary || g.opt.exec_fd >= 0 || g.opt.background
+            || g.opt.ready_fd >= 0 || g.opt.share_path != NULL
+            || g.opt.tag != NULL || g.opt.capture_tail != 0
+            || g.opt.log_to_pty != NULL || g.opt.log_from_pty != NULL
+            || g.opt.stat_dir != NULL || g.opt.success_prompt != NULL
+            || g.opt.failure_prompt != NULL || g.opt.shell_prompt != NULL
+            || g.opt.retries != 0
+            || g.opt.timeout != 0 || g.opt.fatal_no_prompt;
+
+        for (i = 0; i < PHASE_MAX; ++i) {
+            relay = relay || g.opt.deadline[i] != 0;
+        }
+        if (relay) {
+            fatal(ERROR_USAGE, "Error: '-a' only works with -c, -C, -i, -n, -p, -P and -y");
+        }
+    }
+    if (g.opt.shell_prompt != NULL && g.opt.exec_fd >= 0) {
+        fatal(ERROR_USAGE, "Error: '-q' can't be used with '-x'");
+    }
+    if (g.opt.share_control && g.opt.share_path == NULL) {
+        fatal(ERROR_USAGE, "Error: '-w' requires '-s'");
+    }
+    if (g.opt.capture_head != 0 && g.opt.capture_tail == 0) {
+        fatal(ERROR_USAGE, "Error: '-K' requires '-k'");
+    }
+    if (g.opt.capture_tail != 0) {
+        g.capture.head = malloc(g.opt.capture_head + 1);
+        g.capture.tail = malloc(g.opt.capture_tail);
+        if (g.capture.head == NULL || g.capture.tail == NULL) {
+            fatal(ERROR_USAGE, "Error: not enough memory for '-k'");
+        }
+    }
+    /* connection failed */
+    if (g.opt.failure_prompt != NULL) {
+        r = regcomp(&g.opt.re_failure, g.opt.failure_prompt, reflag);
+        if (r != 0) {
+            fatal(ERROR_USAGE, "Error: invalid RE for failure pattern");
+        }
+    }
+    /* logged in */
+    if (g.opt.success_prompt != NULL) {
+        r = regcomp(&g.opt.re_success, g.opt.success_prompt, reflag);
+        if (r != 0) {
+            fatal(ERROR_USAGE, "Error: invalid RE for success pattern");
+        }
+    }
+    /* shell prompt */
+    if (g.opt.shell_prompt != NULL) {
+        r = regcomp(&g.opt.re_shell, g.opt.shell_prompt, reflag);
+        if (r != 0) {
+            fatal(ERROR_USAGE, "Error: invalid RE for shell prompt");
+        }
     }
 }
 
@@ -435,49 +939,58 @@ pty_fork(int *ptrfdm, char *slave_name, int slave_namesz,
     }
 }
 
-int
-tty_raw(int fd, struct termios *save_termios)
+/*
+ * Raw and 8-bit clean: for the user's tty, and for the pty with `-B'.
+ */
+void
+termios_raw(struct termios *buf)
 {
-    int err;
-    struct termios buf;
-
-    if (tcgetattr(fd, &buf) < 0)
-        return (-1);
-    *save_termios = buf;
-
     /*
      * Echo off, canonical mode off, extended input
      * processing off, signal chars off.
      */
-    buf.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    buf->c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
     /*
      * No SIGINT on BREAK, CR-to-NL off, input parity
      * check off, don't strip 8th bit on input, output
      * flow control off.
      */
-    buf.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    buf->c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
 
     /*
      * Clear size bits, parity checking off.
      */
-    buf.c_cflag &= ~(CSIZE | PARENB);
+    buf->c_cflag &= ~(CSIZE | PARENB);
 
     /*
      * Set 8 bits/char.
      */
-    buf.c_cflag |= CS8;
+    buf->c_cflag |= CS8;
 
     /*
      * Output processing off.
      */
-    buf.c_oflag &= ~(OPOST);
+    buf->c_oflag &= ~(OPOST);
 
     /*
      * Case B: 1 byte at a time, no timer.
      */
-    buf.c_cc[VMIN] = 1;
-    buf.c_cc[VTIME] = 0;
+    buf->c_cc[VMIN] = 1;
+    buf->c_cc[VTIME] = 0;
+}
+
+int
+tty_raw(int fd, struct termios *save_termios)
+{
+    int err;
+    struct termios buf;
+
+    if (tcgetattr(fd, &buf) < 0)
+        return (-1);
+    *save_termios = buf;
+
+    termios_raw(&buf);
     if (tcsetattr(fd, TCSAFLUSH, &buf) < 0)
         return (-1);
 
@@ -524,6 +1037,27 @@ tty_atexit(void)
     }
 }
 
+/*
+ * `-B': put the child's pty in raw mode (no echo, no CR/NL translation) so
+ * the session is 8-bit clean.
+ *
+ * NOTE: Use TCSANOW. TCSAFLUSH would discard data not yet read by the child.
+ */
+int
+pty_binary(int fd)
+{
+    struct termios buf;
+
+    if (tcgetattr(fd, &buf) < 0)
+        return (-1);
+
+    termios_raw(&buf);
+    if (tcsetattr(fd, TCSANOW, &buf) < 0)
+        return (-1);
+
+    return (0);
+}
+
 ssize_t
 read_if_ready(int fd, char *buf, size_t n)
 {
@@ -613,79 +1147,1454 @@ sig_winch(int signum)
     return;
 }
 
-#define write2(fd1, fd2, buf, len) \
-    do { \
-        int fds[2] = { fd1, fd2 }; \
-        int i; \
-        for (i = 0; i < 2; ++i) { \
-            if (fds[i] < 0) { \
-                continue; \
-            } \
-            if (writen(fds[i], buf, (len) ) != (len) ) { \
-                fatal_sys("write: fd %d", fds[i]); \
-            } \
-        } \
-    } while (0)
+/*
+ * Timestamps used for the `-d' deadlines.
+ */
+struct phase_clock {
+    long long session_start;    /* of the first attempt (`-r') */
+    long long start;
+    long long last_prompt;  /* last password prompt (for `-t') */
+    long long last_output;
+    long long pw_sent;      /* password sent, no output yet; or -1 */
+    bool seen_output;
+    int passwords_seen;
+};
+
+bool
+is_blank(const char *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        if (buf[i] != '\r' && buf[i] != '\n' && buf[i] != ' ' && buf[i] != '\t') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * The protocol core. It decides what to do about the output from the child
+ * (answer `yes/no', send the password, give up, ...) and about time (the
+ * deadlines), but does no I/O and doesn't read the clock itself. The loop
+ * feeds it with bytes and time and carries out the actions it returns, so it
+ * could as well be driven by another loop or a test harness without a pty.
+ * It doesn't look at `g' either: the options come in a `struct proto_conf'.
+ */
+#define ACT_YESNO       0x01    /* answer `yes' */
+#define ACT_PASSWORD    0x02    /* send the password */
+#define ACT_FATAL       0x04    /* exit with `rcode' and `msg' */
+#define ACT_READY       0x08    /* logged in */
+#define ACT_FAILED      0x10    /* failed before login, retry (`-r') */
+#define ACT_SHELL       0x20    /* shell prompt, send the next line (`-q') */
+
+/* what the core goes by, so each `struct proto' can have its own */
+struct proto_conf {
+    int tries;                  /* `-c' */
+    bool fatal_more_tries;      /* `-C' */
+    long timeout;               /* `-t', ms */
+    bool fatal_no_prompt;       /* `-T' */
+    long deadline[PHASE_MAX];   /* `-d', ms */
+    const regex_t *re_prompt;
+    const regex_t *re_yesno;    /* these may be NULL */
+    const regex_t *re_failure;
+    const regex_t *re_success;
+    const regex_t *re_shell;
+};
+
+struct proto {
+    const struct proto_conf *conf;
+    struct phase_clock pc;
+    bool given_up;
+    bool interactive;
+    bool ready;
+    bool input_done;                /* `-q': all sent */
+    char buf[2 * BUFFSIZE + 1];     /* `+1' for adding the '\000' */
+    char *cache;
+    int ncache;
+    int rcode;
+    char msg[128];
+};
+
 void
-big_loop()
+proto_init(struct proto *p, const struct proto_conf *conf, long long now)
 {
-    char buf1[BUFFSIZE];          /* for read() from stdin */
-    char buf2[2 * BUFFSIZE + 1];  /* for read() from ptym, `+1' for adding the '\000' */
-    char *cache = buf2;
-    int nread, ncache = 0;
-    struct timeval select_timeout;
-    fd_set readfds;
-    int i, r, status;
-    regmatch_t re_match[1];
-    time_t last_time = time(NULL);
-    bool given_up = false;
-    int passwords_seen = 0;
-    int fd_to_pty = -1, fd_from_pty = -1;
-    bool stdin_eof = false;
-    int exit_code = -1;
-    pid_t wait_return;
+    memset(p, 0, sizeof(*p) );
+    p->conf = conf;
+    p->pc.session_start = p->pc.start = now;
+    p->pc.last_prompt = p->pc.last_output = now;
+    p->pc.pw_sent = -1;
+    p->cache = p->buf;
+}
 
-    if (g.opt.log_to_pty != NULL) {
-        fd_to_pty = open(g.opt.log_to_pty, O_CREAT | O_WRONLY | O_TRUNC, 0600);
-        if (fd_to_pty < 0) {
-            fatal_sys("open: %s", g.opt.log_to_pty);
+int
+proto_fatal(struct proto *p, int rcode, const char *msg)
+{
+    p->rcode = rcode;
+    snprintf(p->msg, sizeof(p->msg), "%s", msg);
+    return ACT_FATAL;
+}
+
+/*
+ * Time goes by. Sets `*wait_ms' to the number of ms until the nearest
+ * deadline, but at most its current value.
+ */
+int
+proto_tick(struct proto *p, long long now, long *wait_ms)
+{
+    const struct phase_clock *pc = &p->pc;
+    long long since[PHASE_MAX];
+    long long left;
+    int i;
+
+    since[PHASE_FIRST] = pc->seen_output ? -1 : pc->start;
+    since[PHASE_PROMPT] = pc->passwords_seen > 0 ? -1 : pc->start;
+    since[PHASE_AUTH] = pc->pw_sent;
+    since[PHASE_IDLE] = pc->last_output;
+    since[PHASE_TOTAL] = pc->session_start;
+
+    for (i = 0; i < PHASE_MAX; ++i) {
+        if (p->conf->deadline[i] == 0 || since[i] < 0) {
+            continue;
+        }
+        left = since[i] + p->conf->deadline[i] - now;
+        if (left <= 0) {
+            return proto_fatal(p, phases[i].rcode, phases[i].msg);
+        }
+        if (left < *wait_ms) {
+            *wait_ms = left;
         }
     }
-    if (g.opt.log_from_pty != NULL) {
-        fd_from_pty = open(g.opt.log_from_pty, O_CREAT | O_WRONLY | O_TRUNC, 0600);
-        if (fd_from_pty < 0) {
-            fatal_sys("open: %s", g.opt.log_from_pty);
+
+    if (p->conf->timeout != 0 && p->conf->fatal_no_prompt && pc->passwords_seen == 0) {
+        left = pc->last_prompt + p->conf->timeout - now;
+        if (left < 0) {
+            return proto_fatal(p, ERROR_TIMEOUT, "timeout waiting for password prompt");
+        }
+        if (left + 1 < *wait_ms) {
+            *wait_ms = left + 1;
         }
     }
 
-    /*
-     * wait for the child to open the pty
-     */
-    do {
-        /*
-         * On Mac, fcntl(O_NONBLOCK) may fail before the child opens the pty
-         * slave side. So wait a while for the child to open the pty slave.
-         */
-        fd_set writefds;
+    return 0;
+}
 
-        select_timeout.tv_sec = 1;
-        select_timeout.tv_usec = 0;
+/*
+ * The user starts typing.
+ */
+void
+proto_input(struct proto *p)
+{
+    p->interactive = true;
+}
 
-        FD_ZERO(&writefds);
-        FD_SET(g.fd_ptym, &writefds);
+/*
+ * `-q': nothing more to send, stop watching for the shell prompt.
+ */
+void
+proto_input_done(struct proto *p)
+{
+    p->input_done = true;
+}
 
-        select(g.fd_ptym + 1, NULL, &writefds, NULL, &select_timeout);
-        if (! FD_ISSET(g.fd_ptym, &writefds) ) {
-            fatal(ERROR_GENERAL, "failed to wait for ptym to be writable");
-        }
-    } while (0);
+/*
+ * No more passwords.
+ */
+void
+proto_give_up(struct proto *p)
+{
+    p->given_up = true;
+}
 
-    while (true) {
-L_chk_sigchld:
-        if (g.SIGCHLDed) {
-            /*
-             * NOTE:
-             *  - WCONTINUED does not work on macOS (10.12.5)
+/*
+ * The child has exited. `ssh -f' exits with 0 after forking itself into
+ * background.
+ */
+int
+proto_exit(struct proto *p, int code)
+{
+    if (code == 0 && p->pc.passwords_seen > 0 && ! p->ready) {
+        p->ready = true;
+        return ACT_READY;
+    }
+    if (code != 0 && p->pc.passwords_seen == 0) {
+        return ACT_FAILED;
+    }
+    return 0;
+}
+
+/* still answering prompts? */
+#define proto_matching(p)  (! (p)->interactive && ! (p)->given_up)
+
+/* still watching for the `-S' pattern? */
+#define proto_want_ready(p) \
+    ((p)->conf->re_success != NULL && ! (p)->ready \
+     && ((p)->pc.passwords_seen > 0 || proto_matching(p) ) )
+
+/* still watching for the `-q' pattern? */
+#define proto_want_shell(p)  ((p)->conf->re_shell != NULL && ! (p)->input_done)
+
+/*
+ * Output from the child.
+ */
+int
+proto_output(struct proto *p, const char *data, int len, long long now)
+{
+    struct phase_clock *pc = &p->pc;
+    regmatch_t re_match[1];
+    char *cache;
+    int i, n, act = 0;
+    bool want_failure = false;
+
+    pc->seen_output = true;
+    pc->last_output = now;
+    if (pc->pw_sent >= 0 && ! is_blank(data, len) ) {
+        pc->pw_sent = -1;
+    }
+
+    if (! p->given_up && p->conf->timeout != 0
+        && now - pc->last_prompt >= p->conf->timeout) {
+        p->given_up = true;
+    }
+
+    /* `-E' only before the password prompt */
+    if (p->conf->re_failure != NULL && pc->passwords_seen == 0
+        && proto_matching(p) ) {
+        want_failure = true;
+    }
+
+    while (len > 0 && (proto_matching(p) || proto_want_ready(p)
+                       || proto_want_shell(p) ) ) {
+        cache = p->cache;
+        n = p->buf + 2 * BUFFSIZE - (cache + p->ncache);
+        if (n > len) {
+            n = len;
+        }
+        memcpy(cache + p->ncache, data, n);
+        data += n;
+        len -= n;
+
+        /* regexec() does not like NULLs */
+        for (i = 0; i < n; ++i) {
+            if (cache[p->ncache + i] == 0) {
+                cache[p->ncache + i] = 0xff;
+            }
+        }
+        p->ncache += n;
+        /* make it NULL-terminated so regexec() would be happy */
+        cache[p->ncache] = 0;
+
+        /* match password prompt and send the password */
+        if (proto_matching(p) && p->conf->re_yesno != NULL && pc->passwords_seen == 0
+            && regexec(p->conf->re_yesno, cache, 1, re_match, 0) == 0)
+        {
+            /*
+             * (yes/no)?
+             */
+            act |= ACT_YESNO;
+
+            p->ncache -= re_match[0].rm_eo;
+            p->cache += re_match[0].rm_eo;
+        } else if (proto_matching(p)
+            && regexec(p->conf->re_prompt, cache, 1, re_match, 0) == 0) {
+            /*
+             * Password:
+             */
+            ++pc->passwords_seen;
+
+            pc->last_prompt = now;
+
+            if (p->conf->fatal_more_tries) {
+                if (p->conf->tries != 0 && pc->passwords_seen > p->conf->tries) {
+                    snprintf(p->msg, sizeof(p->msg),
+                        "still prompted for passwords after %d tries", p->conf->tries);
+                    p->rcode = ERROR_MAX_TRIES;
+                    return act | ACT_FATAL;
+                }
+            } else if (p->conf->tries != 0 && pc->passwords_seen >= p->conf->tries) {
+                p->given_up = true;
+            }
+
+            act |= ACT_PASSWORD;
+            pc->pw_sent = now;
+
+            p->ncache -= re_match[0].rm_eo;
+            p->cache += re_match[0].rm_eo;
+        } else if (want_failure && pc->passwords_seen == 0
+            && regexec(p->conf->re_failure, cache, 1, re_match, 0) == 0) {
+            /*
+             * Connection failed
+             */
+            act |= ACT_FAILED;
+            want_failure = false;
+
+            p->ncache -= re_match[0].rm_eo;
+            p->cache += re_match[0].rm_eo;
+        } else if (proto_want_ready(p)
+            && regexec(p->conf->re_success, cache, 1, re_match, 0) == 0) {
+            /*
+             * Logged in
+             */
+            act |= ACT_READY;
+            p->ready = true;
+
+            p->ncache -= re_match[0].rm_eo;
+            p->cache += re_match[0].rm_eo;
+        } else if (proto_want_shell(p)
+            && regexec(p->conf->re_shell, cache, 1, re_match, 0) == 0) {
+            /*
+             * Shell prompt
+             */
+            act |= ACT_SHELL;
+
+            p->ncache -= re_match[0].rm_eo;
+            p->cache += re_match[0].rm_eo;
+        }
+
+        if (p->cache + p->ncache >= p->buf + 2 * BUFFSIZE) {
+            if (p->ncache > BUFFSIZE) {
+                p->cache += p->ncache - BUFFSIZE;
+                p->ncache = BUFFSIZE;
+            }
+            memmove(p->buf, p->cache, p->ncache);
+            p->cache = p->buf;
+        }
+    }
+
+    if (! proto_matching(p) && ! proto_want_ready(p) && ! proto_want_shell(p) ) {
+        p->cache = p->buf;
+        p->ncache = 0;
+    }
+
+    return act;
+}
+
+void
+stat_atexit(void)
+{
+    if (g.stat_file != NULL) {
+        unlink(g.stat_file);
+    }
+}
+
+/*
+ * `-m'
+ */
+void
+stat_open(char **command)
+{
+    char path[1024];
+    int fd, i;
+    size_t len;
+
+    snprintf(path, sizeof(path), "%s/passh.%ld", g.opt.stat_dir, (long) getpid() );
+    fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        fatal_sys("open: %s", path);
+    }
+    if (ftruncate(fd, sizeof(struct passh_stat) ) < 0) {
+        fatal_sys("ftruncate: %s", path);
+    }
+    g.stat = mmap(NULL, sizeof(struct passh_stat), PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    if (g.stat == MAP_FAILED) {
+        fatal_sys("mmap: %s", path);
+    }
+    close(fd);
+
+    g.stat_file = strdup(path);
+    if (atexit(stat_atexit) < 0)
+        fatal_sys("atexit error");
+
+    g.stat->version = STAT_VERSION;
+    g.stat->pid = getpid();
+    g.stat->child_pid = g.child_pid;
+    g.stat->attempts = g.attempts;
+    g.stat->start_ms = g.stat->last_activity_ms = now_ms();
+    for (i = 0, len = 0; command[i] != NULL; ++i) {
+        snprintf(g.stat->command + len, sizeof(g.stat->command) - len,
+            "%s%s", i ? " " : "", command[i]);
+        len = strlen(g.stat->command);
+    }
+    mem_barrier();
+    /* readers ignore the file until the magic is there */
+    g.stat->magic = STAT_MAGIC;
+}
+
+/*
+ * Publish the counters. No syscalls here as it's called for every chunk.
+ */
+void
+stat_publish(const struct phase_clock *pc, int nin, int nout, long long now)
+{
+    struct passh_stat *st = g.stat;
+
+    if (st == NULL) {
+        return;
+    }
+
+    st->seq++;
+    mem_barrier();
+
+    st->bytes_in += nin;
+    st->bytes_out += nout;
+    st->last_activity_ms = now;
+    st->passwords_seen = pc->passwords_seen;
+    st->child_pid = g.child_pid;
+    st->attempts = g.attempts;
+    if (! pc->seen_output) {
+        st->phase = STAT_START;
+    } else if (pc->pw_sent >= 0) {
+        st->phase = STAT_AUTH;
+    } else if (pc->passwords_seen > 0) {
+        st->phase = STAT_SESSION;
+    } else {
+        st->phase = STAT_RUNNING;
+    }
+
+    mem_barrier();
+    st->seq++;
+}
+
+/*
+ * `-x': Each command line is run in the remote shell as
+ *
+ *   printf '\036<nonce>B<seq>\036\n'; eval '<command>'; printf '\036<nonce>E<seq>:%d\036\n' "$?"
+ *
+ * and the pty output is scanned for the markers. The output between them is
+ * passed to the caller as
+ *
+ *   D <seq> <len>\n<len bytes>    (some) output of command <seq>
+ *   E <seq> <status>\n            command <seq> has completed
+ *
+ * The command lines themselves only have `\036' as text so the markers can
+ * not be matched in the echo (if any).
+ */
+void
+exec_write(int fd, const char *buf, int len)
+{
+    if (writen(fd, buf, len) != len) {
+        fatal_sys("write: fd %d", fd);
+    }
+}
+
+void
+exec_start(int fd_log)
+{
+    char buf[256];
+    unsigned long nonce;
+    int n;
+
+    nonce = (unsigned long) getpid() * 2654435761UL ^ (unsigned long) now_ms()
+        ^ (unsigned long) time(NULL) << 16;
+    snprintf(g.exec.marker, sizeof(g.exec.marker), "\036%08lx", nonce & 0xffffffffUL);
+
+    /* no echo and no prompts from the remote shell */
+    n = snprintf(buf, sizeof(buf),
+        "stty -echo 2>/dev/null; PS1=; PS2=; printf '\\036%sR\\036\\n'\n",
+        g.exec.marker + 1);
+    exec_write(g.fd_ptym, buf, n);
+    if (fd_log >= 0) {
+        write(fd_log, buf, n);
+    }
+    g.exec.state = EXEC_HANDSHAKE;
+    g.exec.done_seq = g.exec.seq = 0;
+}
+
+/*
+ * Queue a command to be written to the pty. The pty is not written to
+ * directly or we could block while the shell is blocked writing its output.
+ */
+void
+exec_command(const char *line, int len, int fd_log)
+{
+    char *buf = g.exec.pend + g.exec.npend;
+    int room = sizeof(g.exec.pend) - g.exec.npend;
+    int i, n, r;
+
+    ++g.exec.seq;
+    n = snprintf(buf, room, "printf '\\036%sB%ld\\036\\n'; eval '",
+        g.exec.marker + 1, g.exec.seq);
+    for (i = 0; i < len && n + 4 < room; ++i) {
+        if (line[i] == '\'') {
+            memcpy(buf + n, "'\\''", 4);
+            n += 4;
+        } else {
+            buf[n++] = line[i];
+        }
+    }
+    /* pipelined, so the commands after it must not be read as its input */
+    r = snprintf(buf + n, room - n, "' </dev/null; printf '\\036%sE%ld:%%d\\036\\n' \"$?\"\n",
+        g.exec.marker + 1, g.exec.seq);
+    /* exec_fill() leaves room for the longest command */
+    if (i < len || r < 0 || r >= room - n) {
+        fatal(ERROR_GENERAL, "no room for command %ld", g.exec.seq);
+    }
+    n += r;
+
+    if (fd_log >= 0) {
+        write(fd_log, buf, n);
+    }
+    g.exec.npend += n;
+}
+
+/*
+ * Move complete command lines to the pending buffer, as long as there are
+ * not too many commands in flight.
+ */
+void
+exec_fill(int fd_log)
+{
+    char *p = g.exec.line, *end = g.exec.line + g.exec.nline, *nl;
+    int len;
+
+    while (g.exec.npend < EXEC_MAX_PENDING
+        && g.exec.seq - g.exec.done_seq < EXEC_MAX_INFLIGHT
+        && (nl = memchr(p, '\n', end - p) ) != NULL) {
+        len = nl - p;
+        if (len > 0 && p[len - 1] == '\r') {
+            --len;
+        }
+        if (len > 0) {
+            exec_command(p, len, fd_log);
+        }
+        p = nl + 1;
+    }
+    g.exec.nline = end - p;
+    memmove(g.exec.line, p, g.exec.nline);
+
+    if (g.exec.eof && ! g.exec.exit_sent && g.exec.npend < EXEC_MAX_PENDING
+        && memchr(g.exec.line, '\n', g.exec.nline) == NULL) {
+        /* the last line without a newline */
+        if (g.exec.nline > 0) {
+            exec_command(g.exec.line, g.exec.nline, fd_log);
+            g.exec.nline = 0;
+        }
+        memcpy(g.exec.pend + g.exec.npend, "exit\n", 5);
+        g.exec.npend += 5;
+        g.exec.exit_sent = true;
+    }
+}
+
+/*
+ * Read command lines from the `-x' fd.
+ */
+void
+exec_read(int fd_log)
+{
+    int nread;
+
+    nread = read(g.opt.exec_fd, g.exec.line + g.exec.nline,
+        sizeof(g.exec.line) - g.exec.nline);
+    if (nread < 0) {
+        fatal_sys("read: fd %d", g.opt.exec_fd);
+    } else if (nread == 0) {
+        g.exec.eof = true;
+    }
+    g.exec.nline += nread;
+
+    exec_fill(fd_log);
+    if (g.exec.nline == sizeof(g.exec.line)
+        && memchr(g.exec.line, '\n', g.exec.nline) == NULL) {
+        fatal(ERROR_GENERAL, "command too long (fd %d)", g.opt.exec_fd);
+    }
+}
+
+/*
+ * Write as much of the pending commands as the pty would take.
+ */
+void
+exec_flush()
+{
+    int flags, nwritten;
+
+    flags = fcntl(g.fd_ptym, F_GETFL);
+    fcntl(g.fd_ptym, F_SETFL, flags | O_NONBLOCK);
+    nwritten = write(g.fd_ptym, g.exec.pend, g.exec.npend);
+    fcntl(g.fd_ptym, F_SETFL, flags);
+
+    if (nwritten < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return;
+        }
+        fatal_sys("write: fd %d", g.fd_ptym);
+    }
+    g.exec.npend -= nwritten;
+    memmove(g.exec.pend, g.exec.pend + nwritten, g.exec.npend);
+}
+
+/*
+ * Is there a marker at `p'? Returns its length, 0 if not a marker, or -1 if
+ * more data is needed to tell.
+ */
+int
+exec_marker(const char *p, int n, char *type, long *a, long *b)
+{
+    int mlen = strlen(g.exec.marker);
+    long *field = a;
+    int i;
+
+    for (i = 0; i < mlen; ++i) {
+        if (i >= n) {
+            return -1;
+        }
+        if (p[i] != g.exec.marker[i]) {
+            return 0;
+        }
+    }
+    if (i >= n) {
+        return -1;
+    }
+    *type = p[i++];
+    if (*type != 'B' && *type != 'E' && *type != 'R') {
+        return 0;
+    }
+    *a = *b = 0;
+    for ( ; i < EXEC_MAX_MARKER; ++i) {
+        if (i >= n) {
+            return -1;
+        }
+        if (p[i] == '\036') {
+            return i + 1;
+        } else if (p[i] >= '0' && p[i] <= '9') {
+            *field = *field * 10 + p[i] - '0';
+        } else if (p[i] == ':' && field == a) {
+            field = b;
+        } else {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+void
+exec_data(const char *buf, int len)
+{
+    char hdr[64];
+    int n;
+
+    if (! g.exec.inside) {
+        /* shell noise */
+        return;
+    }
+    n = snprintf(hdr, sizeof(hdr), "D %ld %d\n", g.exec.cur, len);
+    exec_write(g.exec.out, hdr, n);
+    exec_write(g.exec.out, buf, len);
+}
+
+/*
+ * Scan output from the pty for the markers.
+ */
+void
+exec_scan(const char *buf, int len)
+{
+    static char data[EXEC_MAX_MARKER + 2 * BUFFSIZE];
+    char hdr[64];
+    char *p, *end, *rs;
+    char type;
+    long a, b;
+    int n;
+
+    memcpy(data, g.exec.hold, g.exec.nhold);
+    memcpy(data + g.exec.nhold, buf, len);
+    p = data;
+    end = data + g.exec.nhold + len;
+    g.exec.nhold = 0;
+
+    while (p < end) {
+        /* the newline after a marker */
+        if (g.exec.skip_nl) {
+            if (*p == '\r') {
+                ++p;
+                continue;
+            }
+            g.exec.skip_nl = false;
+            if (*p == '\n') {
+                ++p;
+                continue;
+            }
+        }
+
+        if ((rs = memchr(p, '\036', end - p) ) == NULL) {
+            rs = end;
+        }
+        if (rs > p) {
+            exec_data(p, rs - p);
+            p = rs;
+            continue;
+        }
+
+        n = exec_marker(p, end - p, &type, &a, &b);
+        if (n < 0) {
+            g.exec.nhold = end - p;
+            memcpy(g.exec.hold, p, g.exec.nhold);
+            return;
+        } else if (n == 0) {
+            exec_data(p, 1);
+            ++p;
+            continue;
+        }
+        p += n;
+        g.exec.skip_nl = true;
+
+        if (type == 'R') {
+            g.exec.state = EXEC_READY;
+        } else if (type == 'B') {
+            g.exec.inside = true;
+            g.exec.cur = a;
+        } else if (type == 'E' && g.exec.inside && a == g.exec.cur) {
+            n = snprintf(hdr, sizeof(hdr), "E %ld %ld\n", a, b);
+            exec_write(g.exec.out, hdr, n);
+            g.exec.inside = false;
+            g.exec.done_seq = a;
+        }
+    }
+}
+
+/*
+ * `-g': write out the line buffered so far, as one write().
+ */
+void
+tag_flush(int fd)
+{
+    int n = g.tag.nline;
+
+    if (n == 0) {
+        return;
+    }
+    if (g.tag.line[n - 1] != '\n') {
+        g.tag.line[n++] = '\n';
+    }
+    /* before fatal_sys(), which flushes too */
+    g.tag.nline = 0;
+    if (writen(fd, g.tag.line, n) != n) {
+        fatal_sys("write: fd %d", fd);
+    }
+}
+
+/*
+ * `-g': buffer the output per line and prefix each line with the label (and
+ * the time), so the lines of many passh's writing to the same pipe or file
+ * (O_APPEND) do not mix.
+ */
+void
+tag_write(int fd, const char *buf, int len)
+{
+    const char *nl;
+    int n, room;
+
+    while (len > 0) {
+        if (g.tag.nline == 0) {
+            if (g.opt.tag_time) {
+                struct timeval tv;
+                struct tm tm;
+
+                gettimeofday(&tv, NULL);
+                localtime_r(&tv.tv_sec, &tm);
+                g.tag.nline = snprintf(g.tag.line, sizeof(g.tag.line),
+                    "%s %02d:%02d:%02d.%03d ", g.opt.tag, tm.tm_hour, tm.tm_min,
+                    tm.tm_sec, (int) (tv.tv_usec / 1000) );
+            } else {
+                g.tag.nline = snprintf(g.tag.line, sizeof(g.tag.line), "%s ",
+                    g.opt.tag);
+            }
+            if (g.tag.nline > sizeof(g.tag.line) / 2) {
+                g.tag.nline = sizeof(g.tag.line) / 2;
+            }
+        }
+
+        /* leave room for the '\n' added for a split line */
+        room = sizeof(g.tag.line) - 1 - g.tag.nline;
+        nl = memchr(buf, '\n', len < room ? len : room);
+        n = nl != NULL ? nl - buf + 1 : (len < room ? len : room);
+
+        memcpy(g.tag.line + g.tag.nline, buf, n);
+        g.tag.nline += n;
+        buf += n;
+        len -= n;
+
+        if (nl != NULL || n == room) {
+            tag_flush(fd);
+        }
+    }
+}
+
+void
+stdout_emit(int fd, const char *buf, int len)
+{
+    if (g.opt.tag != NULL) {
+        tag_write(fd, buf, len);
+    } else if (writen(fd, buf, len) != len) {
+        fatal_sys("write: fd %d", fd);
+    }
+}
+
+/*
+ * `-k', `-K': keep the head and the tail of the output in memory.
+ */
+void
+capture_write(const char *buf, size_t len)
+{
+    size_t n;
+
+    g.capture.total += len;
+
+    if (g.capture.nhead < g.opt.capture_head) {
+        n = g.opt.capture_head - g.capture.nhead;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(g.capture.head + g.capture.nhead, buf, n);
+        g.capture.nhead += n;
+        buf += n;
+        len -= n;
+    }
+
+    /* only the last `capture_tail' bytes matter */
+    if (len > g.opt.capture_tail) {
+        buf += len - g.opt.capture_tail;
+        len = g.opt.capture_tail;
+    }
+    while (len > 0) {
+        n = g.opt.capture_tail - g.capture.pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(g.capture.tail + g.capture.pos, buf, n);
+        g.capture.pos = (g.capture.pos + n) % g.opt.capture_tail;
+        if (g.capture.ntail < g.opt.capture_tail) {
+            g.capture.ntail += n;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * `-k': print what's been kept and the exit status. Called on exit.
+ */
+void
+capture_dump(int rcode)
+{
+    unsigned long long skipped;
+    char msg[128], last = '\n';
+    int n;
+
+    /* not the child, and only once */
+    if (g.capture.tail == NULL || g.child_pid <= 0 || g.capture.dumped) {
+        return;
+    }
+    g.capture.dumped = true;
+
+    stdout_emit(STDOUT_FILENO, g.capture.head, g.capture.nhead);
+    skipped = g.capture.total - g.capture.nhead - g.capture.ntail;
+    if (skipped > 0) {
+        n = snprintf(msg, sizeof(msg), "%s[passh: %llu bytes skipped]\n",
+            g.capture.nhead > 0 && g.capture.head[g.capture.nhead - 1] != '\n'
+            ? "\n" : "", skipped);
+        stdout_emit(STDOUT_FILENO, msg, n);
+    }
+    if (g.capture.ntail < g.opt.capture_tail) {
+        stdout_emit(STDOUT_FILENO, g.capture.tail, g.capture.ntail);
+    } else {
+        stdout_emit(STDOUT_FILENO, g.capture.tail + g.capture.pos,
+            g.opt.capture_tail - g.capture.pos);
+        stdout_emit(STDOUT_FILENO, g.capture.tail, g.capture.pos);
+    }
+    /* the last byte of the output */
+    if (g.capture.ntail > 0) {
+        last = g.capture.tail[(g.capture.pos + g.opt.capture_tail - 1) % g.opt.capture_tail];
+    } else if (g.capture.nhead > 0) {
+        last = g.capture.head[g.capture.nhead - 1];
+    }
+    n = snprintf(msg, sizeof(msg), "%s[passh: exit status %d]\n",
+        last != '\n' ? "\n" : "", rcode);
+    stdout_emit(STDOUT_FILENO, msg, n);
+    if (g.opt.tag != NULL) {
+        tag_flush(STDOUT_FILENO);
+    }
+}
+
+/*
+ * Output from the child to our stdout.
+ */
+void
+stdout_write(int fd, const char *buf, int len)
+{
+    if (fd < 0) {
+        return;
+    }
+    if (g.capture.tail != NULL) {
+        capture_write(buf, len);
+    } else {
+        stdout_emit(fd, buf, len);
+    }
+}
+
+/*
+ * `-N', `-f': tell whoever is waiting that we've logged in.
+ */
+void
+notify_ready()
+{
+    if (g.opt.ready_fd >= 0) {
+        write(g.opt.ready_fd, "\n", 1);
+        close(g.opt.ready_fd);
+        g.opt.ready_fd = -1;
+    }
+    if (g.bg_fd >= 0) {
+        write(g.bg_fd, "\n", 1);
+        close(g.bg_fd);
+        g.bg_fd = -1;
+    }
+}
+
+/*
+ * `-f': fork. The foreground passh waits until the background one has logged
+ * in and exits with 0, or with the background's exit code if it exits first.
+ */
+void
+go_background()
+{
+    int pfd[2], status, fd;
+    pid_t pid;
+    char c;
+    ssize_t r;
+
+    if (pipe(pfd) < 0) {
+        fatal_sys("pipe error");
+    }
+    if ((pid = fork() ) < 0) {
+        fatal_sys("fork error");
+    } else if (pid > 0) {
+        close(pfd[1]);
+        while ((r = read(pfd[0], &c, 1) ) < 0 && errno == EINTR) {
+            ;
+        }
+        if (r == 1) {
+            exit(0);
+        }
+        if (waitpid(pid, &status, 0) < 0) {
+            fatal_sys("waitpid error");
+        }
+        exit(WIFEXITED(status) ? WEXITSTATUS(status) : ERROR_GENERAL);
+    }
+
+    close(pfd[0]);
+    g.pid = getpid();
+    g.bg_fd = pfd[1];
+    fcntl(g.bg_fd, F_SETFD, FD_CLOEXEC);
+
+    /* like `ssh -f' */
+    setsid();
+    if ((fd = open("/dev/null", O_RDWR) ) >= 0) {
+        dup2(fd, STDIN_FILENO);
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+    }
+}
+
+#define write2(fd1, fd2, buf, len) \
+    do { \
+        int fds[2] = { fd1, fd2 }; \
+        int i; \
+        for (i = 0; i < 2; ++i) { \
+            if (fds[i] < 0) { \
+                continue; \
+            } \
+            if (writen(fds[i], buf, (len) ) != (len) ) { \
+                fatal_sys("write: fd %d", fds[i]); \
+            } \
+        } \
+    } while (0)
+
+void
+share_atexit(void)
+{
+    /* not in a child which failed to exec */
+    if (g.share.pid == getpid() ) {
+        unlink(g.opt.share_path);
+    }
+}
+
+/*
+ * `-s': listen on the unix socket. Only the owner can connect to it.
+ */
+void
+share_open()
+{
+    struct sockaddr_un sa;
+    struct stat sb;
+    mode_t mask;
+    int fd, r;
+
+    if (strlen(g.opt.share_path) >= sizeof(sa.sun_path) ) {
+        fatal(ERROR_USAGE, "Error: socket path too long: %s", g.opt.share_path);
+    }
+    memset(&sa, 0, sizeof(sa) );
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, g.opt.share_path);
+
+    /* left by a passh which was killed? */
+    if (lstat(g.opt.share_path, &sb) == 0 && S_ISSOCK(sb.st_mode) ) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0) ) < 0) {
+            fatal_sys("socket error");
+        }
+        r = connect(fd, (struct sockaddr *) &sa, sizeof(sa) );
+        close(fd);
+        if (r == 0) {
+            fatal(ERROR_GENERAL, "socket in use: %s", g.opt.share_path);
+        }
+        unlink(g.opt.share_path);
+    }
+
+    if ((g.share.fd = socket(AF_UNIX, SOCK_STREAM, 0) ) < 0) {
+        fatal_sys("socket error");
+    }
+    mask = umask(077);
+    r = bind(g.share.fd, (struct sockaddr *) &sa, sizeof(sa) );
+    umask(mask);
+    if (r < 0) {
+        fatal_sys("bind: %s", g.opt.share_path);
+    }
+    if (listen(g.share.fd, 16) < 0) {
+        fatal_sys("listen: %s", g.opt.share_path);
+    }
+    fcntl(g.share.fd, F_SETFD, FD_CLOEXEC);
+    fcntl(g.share.fd, F_SETFL, fcntl(g.share.fd, F_GETFL) | O_NONBLOCK);
+
+    g.share.pid = getpid();
+    if (atexit(share_atexit) < 0)
+        fatal_sys("atexit error");
+
+    /* a viewer may go away any time */
+    sig_handle(SIGPIPE, SIG_IGN);
+}
+
+void
+share_drop(int i)
+{
+    close(g.share.viewers[i].fd);
+    if (g.share.viewers[i].fd == g.share.controller) {
+        g.share.controller = -1;
+    }
+    g.share.viewers[i] = g.share.viewers[--g.share.nviewers];
+}
+
+/*
+ * Send viewer <i> what it hasn't got, without blocking. A viewer which is so
+ * slow that the ring has wrapped over its position misses the overwritten
+ * data. Returns false if the viewer's gone (and was dropped).
+ */
+bool
+share_flush(int i)
+{
+    unsigned long long *pos = &g.share.viewers[i].pos;
+    size_t off, n;
+    ssize_t r;
+
+    if (g.share.head - *pos > SHARE_RING) {
+        *pos = g.share.head - SHARE_RING;
+    }
+    while (*pos < g.share.head) {
+        off = *pos % SHARE_RING;
+        n = SHARE_RING - off;
+        if (n > g.share.head - *pos) {
+            n = g.share.head - *pos;
+        }
+        r = write(g.share.viewers[i].fd, g.share.ring + off, n);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ) {
+            break;
+        } else if (r <= 0) {
+            share_drop(i);
+            return false;
+        }
+        *pos += r;
+    }
+    return true;
+}
+
+/*
+ * Output from the child goes into the ring once, then each viewer is sent
+ * as much of it as it can take right now.
+ */
+void
+share_output(const char *buf, size_t len)
+{
+    size_t off, n;
+    int i;
+
+    if (g.share.fd < 0) {
+        return;
+    }
+    if (len > SHARE_RING) {
+        g.share.head += len - SHARE_RING;
+        buf += len - SHARE_RING;
+        len = SHARE_RING;
+    }
+    while (len > 0) {
+        off = g.share.head % SHARE_RING;
+        n = SHARE_RING - off;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(g.share.ring + off, buf, n);
+        g.share.head += n;
+        buf += n;
+        len -= n;
+    }
+
+    /* from the last one as share_flush() may drop one */
+    for (i = g.share.nviewers - 1; i >= 0; --i) {
+        share_flush(i);
+    }
+}
+
+void
+share_accept()
+{
+    int fd;
+
+    if ((fd = accept(g.share.fd, NULL, NULL) ) < 0) {
+        return;
+    }
+    if (g.share.nviewers == SHARE_MAX_VIEWERS) {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    g.share.viewers[g.share.nviewers].fd = fd;
+    /* start with what's still in the ring so there's some context */
+    g.share.viewers[g.share.nviewers].pos =
+        g.share.head > SHARE_RING ? g.share.head - SHARE_RING : 0;
+    ++g.share.nviewers;
+
+    if (g.opt.share_control && g.share.controller < 0) {
+        g.share.controller = fd;
+    }
+    share_flush(g.share.nviewers - 1);
+}
+
+/*
+ * Input from viewer <i>. Only the controller's (`-w') goes to the pty, like
+ * our stdin. Returns false if the viewer's gone.
+ */
+bool
+share_read(int i, struct proto *p, int fd_to_pty)
+{
+    char buf[BUFFSIZE];
+    ssize_t n;
+
+    n = read(g.share.viewers[i].fd, buf, sizeof(buf) );
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ) {
+        return true;
+    } else if (n <= 0) {
+        share_drop(i);
+        return false;
+    }
+    if (g.share.viewers[i].fd == g.share.controller && g.opt.exec_fd < 0) {
+        proto_input(p);
+        write2(g.fd_ptym, fd_to_pty, buf, n);
+        stat_publish(&p->pc, 0, n, now_ms() );
+    }
+    return true;
+}
+
+/*
+ * The child has exited. Give the viewers a last chance to get the output.
+ */
+void
+share_drain(long ms)
+{
+    long long end = now_ms() + ms;
+    struct timeval tv;
+    fd_set writefds;
+    int i, maxfd;
+    long left;
+
+    while (g.share.fd >= 0 && (left = end - now_ms() ) > 0) {
+        FD_ZERO(&writefds);
+        maxfd = -1;
+        for (i = 0; i < g.share.nviewers; ++i) {
+            if (g.share.viewers[i].pos < g.share.head) {
+                FD_SET(g.share.viewers[i].fd, &writefds);
+                if (g.share.viewers[i].fd > maxfd) {
+                    maxfd = g.share.viewers[i].fd;
+                }
+            }
+        }
+        if (maxfd < 0) {
+            break;
+        }
+        tv.tv_sec = left / 1000;
+        tv.tv_usec = left % 1000 * 1000;
+        if (select(maxfd + 1, NULL, &writefds, NULL, &tv) < 0 && errno != EINTR) {
+            break;
+        }
+        for (i = g.share.nviewers - 1; i >= 0; --i) {
+            if (FD_ISSET(g.share.viewers[i].fd, &writefds) ) {
+                share_flush(i);
+            }
+        }
+    }
+}
+
+/*
+ * `-q': if the shell is waiting, send it the next line held back ('\r' ends
+ * a line too, for a tty in raw mode). What's left without a newline goes at
+ * EOF, or when it fills up the buffer.
+ */
+void
+held_release(struct proto *p, int fd_to_pty)
+{
+    bool line = false;
+    int n;
+
+    if (! g.held.prompted || g.held.n == 0) {
+        return;
+    }
+    for (n = 0; n < g.held.n && ! line; ++n) {
+        line = g.held.buf[n] == '\n' || g.held.buf[n] == '\r';
+    }
+    if (! line && ! g.held.eof && g.held.n < sizeof(g.held.buf) ) {
+        return;
+    }
+
+    write2(g.fd_ptym, fd_to_pty, g.held.buf, n);
+    stat_publish(&p->pc, 0, n, now_ms() );
+    g.held.n -= n;
+    memmove(g.held.buf, g.held.buf + n, g.held.n);
+    /* still waiting for the rest of the line if it's not complete */
+    g.held.prompted = ! line;
+}
+
+/*
+ * Run the command on a new pty.
+ */
+pid_t
+spawn()
+{
+    char slave_name[32];
+    pid_t pid;
+    struct termios orig_termios;
+    struct winsize size;
+    struct timeval select_timeout;
+
+    if (g.stdin_is_tty) {
+        if (g.reset_on_exit) {
+            /* respawn (`-r'), the user's tty is in raw mode now */
+            orig_termios = g.save_termios;
+        } else if (tcgetattr(STDIN_FILENO, &orig_termios) < 0)
+            fatal_sys("tcgetattr error on stdin");
+        if (ioctl(STDIN_FILENO, TIOCGWINSZ, (char *) &size) < 0)
+            fatal_sys("TIOCGWINSZ error");
+
+        pid = pty_fork(&g.fd_ptym, slave_name, sizeof(slave_name),
+            &orig_termios, &size);
+
+    } else {
+        pid = pty_fork(&g.fd_ptym, slave_name, sizeof(slave_name),
+            NULL, NULL);
+    }
+
+    if (pid < 0) {
+        fatal_sys("fork error");
+    } else if (pid == 0) {
+        /*
+         * child
+         */
+        if (g.opt.nohup_child) {
+            sig_handle(SIGHUP, SIG_IGN);
+        }
+        /* ignored by us for `-s' */
+        sig_handle(SIGPIPE, SIG_DFL);
+        if (execvp(g.opt.command[0], g.opt.command) < 0)
+            fatal_sys("can't execute: %s", g.opt.command[0]);
+    }
+
+    /*
+     * parent
+     */
+    ++g.attempts;
+
+    /*
+     * wait for the child to open the pty
+     */
+    do {
+        /*
+         * On Mac, fcntl(O_NONBLOCK) may fail before the child opens the pty
+         * slave side. So wait a while for the child to open the pty slave.
+         */
+        fd_set writefds;
+
+        select_timeout.tv_sec = 1;
+        select_timeout.tv_usec = 0;
+
+        FD_ZERO(&writefds);
+        FD_SET(g.fd_ptym, &writefds);
+
+        select(g.fd_ptym + 1, NULL, &writefds, NULL, &select_timeout);
+        if (! FD_ISSET(g.fd_ptym, &writefds) ) {
+            fatal(ERROR_GENERAL, "failed to wait for ptym to be writable");
+        }
+    } while (0);
+
+    return pid;
+}
+
+/*
+ * `-r': the connection failed before login. Kill the child (if it's still
+ * running) and run the command again after a while.
+ */
+void
+respawn(struct proto *p, bool exited, int fd_stdout, int fd_from_pty)
+{
+    char buf[BUFFSIZE];
+    long long session_start = p->pc.session_start;
+    long delay;
+    int n, status;
+
+    if (g.attempts > g.opt.retries) {
+        fatal(ERROR_RETRIES, "connection failed after %d attempts", g.attempts);
+    }
+
+    /* the error message */
+    while ((n = read_if_ready(g.fd_ptym, buf, sizeof(buf) ) ) > 0) {
+        write2(-1, fd_from_pty, buf, n);
+        share_output(buf, n);
+        if (g.exec.state == EXEC_LOGIN) {
+            stdout_write(fd_stdout, buf, n);
+        }
+    }
+
+    if (! exited) {
+        kill(g.child_pid, SIGTERM);
+    }
+    close(g.fd_ptym);
+    if (! exited) {
+        /* it may ignore SIGTERM */
+        for (n = 0; n < KILL_WAIT / 10; ++n) {
+            if (waitpid(g.child_pid, &status, WNOHANG) != 0) {
+                break;
+            }
+            sleep_ms(10);
+        }
+        if (n == KILL_WAIT / 10) {
+            kill(g.child_pid, SIGKILL);
+            waitpid(g.child_pid, &status, 0);
+        }
+    }
+    g.SIGCHLDed = false;
+    g.pty_binary = false;
+
+    /* exponential backoff with jitter, so many passh's don't retry together */
+    if (g.attempts == 1) {
+        srand(getpid() ^ (unsigned) now_ms() );
+    }
+    delay = g.opt.retry_delay;
+    for (n = 1; n < g.attempts && delay < MAX_RETRY_DELAY; ++n) {
+        delay *= 2;
+    }
+    if (delay > MAX_RETRY_DELAY) {
+        delay = MAX_RETRY_DELAY;
+    }
+    delay = delay / 2 + rand() % (delay / 2 + 1);
+
+    /* `-d total:' counts from the first attempt */
+    if (p->conf->deadline[PHASE_TOTAL] != 0) {
+        long long left = session_start + p->conf->deadline[PHASE_TOTAL] - now_ms();
+
+        if (left <= delay) {
+            sleep_ms(left > 0 ? left : 0);
+            fatal(phases[PHASE_TOTAL].rcode, "%s", phases[PHASE_TOTAL].msg);
+        }
+    }
+    sleep_ms(delay);
+
+    g.child_pid = spawn();
+
+    proto_init(p, p->conf, now_ms() );
+    p->pc.session_start = session_start;
+    stat_publish(&p->pc, 0, 0, now_ms() );
+}
+
+/*
+ * The core's configuration from the command line.
+ */
+void
+proto_conf_opt(struct proto_conf *conf)
+{
+    memset(conf, 0, sizeof(*conf) );
+    conf->tries = g.opt.tries;
+    conf->fatal_more_tries = g.opt.fatal_more_tries;
+    conf->timeout = g.opt.timeout;
+    conf->fatal_no_prompt = g.opt.fatal_no_prompt;
+    memcpy(conf->deadline, g.opt.deadline, sizeof(conf->deadline) );
+    conf->re_prompt = &g.opt.re_prompt;
+    conf->re_yesno = g.opt.auto_yesno ? &g.opt.re_yesno : NULL;
+    conf->re_failure = g.opt.failure_prompt != NULL ? &g.opt.re_failure : NULL;
+    conf->re_success = g.opt.success_prompt != NULL ? &g.opt.re_success : NULL;
+    conf->re_shell = g.opt.shell_prompt != NULL ? &g.opt.re_shell : NULL;
+}
+
+void
+big_loop()
+{
+    char buf1[BUFFSIZE];          /* for read() from stdin */
+    char buf2[2 * BUFFSIZE];      /* for read() from ptym */
+    int nread;
+    struct timeval select_timeout;
+    fd_set readfds;
+    int r, status, act;
+    static struct proto proto;
+    struct proto *p = &proto;
+    struct proto_conf conf;
+    long long now;
+    long wait_ms;
+    int fd_to_pty = -1, fd_from_pty = -1;
+    /* `-x': don't mix the output with the frames */
+    int fd_stdout = g.exec.out == STDOUT_FILENO && g.opt.exec_fd >= 0 ? -1 : STDOUT_FILENO;
+    int maxfd;
+    fd_set writefds;
+    bool stdin_eof = false;
+    int exit_code = -1;
+    pid_t wait_return;
+    int i;
+
+    proto_conf_opt(&conf);
+    proto_init(p, &conf, now_ms() );
+
+    if (g.opt.tag != NULL) {
+        struct stat sb;
+
+        /* one record per write() even if others write to the same file */
+        if (fstat(STDOUT_FILENO, &sb) == 0 && S_ISREG(sb.st_mode) ) {
+            fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) | O_APPEND);
+        }
+    }
+
+    if (g.opt.log_to_pty != NULL) {
+        fd_to_pty = open(g.opt.log_to_pty, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+        if (fd_to_pty < 0) {
+            fatal_sys("open: %s", g.opt.log_to_pty);
+        }
+    }
+    if (g.opt.log_from_pty != NULL) {
+        fd_from_pty = open(g.opt.log_from_pty, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+        if (fd_from_pty < 0) {
+            fatal_sys("open: %s", g.opt.log_from_pty);
+        }
+    }
+
+    while (true) {
+L_chk_sigchld:
+        if (g.SIGCHLDed) {
+            /*
+             * NOTE:
+             *  - WCONTINUED does not work on macOS (10.12.5)
              *  - On macOS, SIGCHLD can be generated when
              *     1. child process has terminated/exited
              *     2. the currently *running* child process is stopped (e.g. by `kill -STOP')
@@ -703,6 +2612,15 @@ L_chk_sigchld:
 
             if (WIFEXITED(status) ) {
                 exit_code = WEXITSTATUS(status);
+                act = proto_exit(p, exit_code);
+                if (act & ACT_READY) {
+                    notify_ready();
+                }
+                if ((act & ACT_FAILED) && g.opt.retries > 0) {
+                    respawn(p, true, fd_stdout, fd_from_pty);
+                    exit_code = -1;
+                    continue;
+                }
                 goto L_done;
             } else if (WIFSIGNALED(status) ) {
                 exit_code = status + 128;
@@ -718,9 +2636,55 @@ L_chk_sigchld:
             }
         }
 
-        if (g.opt.timeout != 0 && g.opt.fatal_no_prompt && passwords_seen == 0
-            && labs(time(NULL) - last_time) > g.opt.timeout) {
-            fatal(ERROR_TIMEOUT, "timeout waiting for password prompt");
+        wait_ms = 1100;
+        if (proto_tick(p, now_ms(), &wait_ms) & ACT_FATAL) {
+            fatal(p->rcode, "%s", p->msg);
+        }
+
+        /*
+         * `-B': go raw after the password has been read. The password reader
+         * (e.g. ssh) restores the tty settings it saved before the prompt so
+         * wait until echo is back on or it would undo our changes. It may go
+         * raw itself right after that (ssh with a remote tty) so also stop
+         * waiting on output after the password, or after BINARY_WAIT ms.
+         * Without a password (e.g. key auth) go on the `-S' pattern.
+         */
+        if (g.opt.binary && ! g.pty_binary && ! stdin_eof
+            && (p->pc.passwords_seen > 0 || p->ready) ) {
+            struct termios term;
+
+            now = now_ms();
+            if (p->pc.pw_sent < 0 || now - p->pc.pw_sent >= BINARY_WAIT
+                || (tcgetattr(g.fd_ptym, &term) == 0 && (term.c_lflag & ECHO) ) ) {
+                if (pty_binary(g.fd_ptym) < 0) {
+                    fatal_sys("failed to set pty to binary mode");
+                }
+                g.pty_binary = true;
+
+                if (g.opt.exec_fd >= 0) {
+                    exec_start(fd_to_pty);
+                    /* no more passwords for the commands' output */
+                    proto_give_up(p);
+                }
+            } else if (wait_ms > 10) {
+                wait_ms = 10;
+            }
+        }
+
+        /*
+         * `-x': output, then nothing for a while and no password prompt. Most
+         * likely logged in without a password; don't wait forever.
+         */
+        if (g.opt.exec_fd >= 0 && g.exec.state == EXEC_LOGIN && ! p->ready
+            && p->pc.passwords_seen == 0 && p->pc.seen_output) {
+            long left = p->pc.last_output + EXEC_LOGIN_WAIT - now_ms();
+
+            if (left <= 0) {
+                fatal(ERROR_GENERAL, "-x: no password prompt (use -S to tell when logged in)");
+            }
+            if (left < wait_ms) {
+                wait_ms = left;
+            }
         }
 
         if (g.received_winch && g.stdin_is_tty) {
@@ -748,18 +2712,14 @@ L_chk_sigchld:
         while (stdin_eof) {
             struct termios term;
             char eof_char;
-            static struct timeval last;
-            struct timeval now;
-            double diff;
+            static long long last;
 
-            if (last.tv_sec == 0) {
-                gettimeofday(&last, NULL);
+            now = now_ms();
+            if (last == 0) {
+                last = now;
                 break;
             }
-
-            gettimeofday(&now, NULL);
-            diff = now.tv_sec + now.tv_usec / 1e6 - (last.tv_sec + last.tv_usec / 1e6);
-            if (diff > -0.05 && diff < 0.05) {
+            if (now - last < 50) {
                 break;
             }
             last = now;
@@ -767,6 +2727,20 @@ L_chk_sigchld:
             if (tcgetattr(g.fd_ptym, &term) < 0) {
                 goto L_done;
             }
+            /*
+             * `-B': VEOF only works in canonical mode. Switch it back on only
+             * now so data written in raw mode has been processed already.
+             * Keep the other raw settings so output is still 8-bit clean.
+             *
+             * NOTE: On Linux a blocking read() which started in raw mode would
+             *       not return on EOF. ssh polls before reading so it's ok.
+             */
+            if (g.pty_binary && ! (term.c_lflag & ICANON) ) {
+                term.c_lflag |= ICANON;
+                if (tcsetattr(g.fd_ptym, TCSANOW, &term) < 0) {
+                    goto L_done;
+                }
+            }
             eof_char = term.c_cc[VEOF];
             if (write(g.fd_ptym, &eof_char, 1) < 0) {
                 goto L_done;
@@ -777,15 +2751,57 @@ L_chk_sigchld:
         }
 
         FD_ZERO(&readfds);
-        if (g.stdin_is_tty && !stdin_eof) {
+        maxfd = g.fd_ptym;
+        if (g.opt.shell_prompt != NULL) {
+            /* not until what's held has gone and the last line's done */
+            if (g.held.eof && g.held.n == 0 && g.held.prompted) {
+                stdin_eof = true;
+                proto_input_done(p);
+            } else if (! g.held.eof && g.held.n < sizeof(g.held.buf) ) {
+                FD_SET(STDIN_FILENO, &readfds);
+            }
+        } else if ((g.stdin_is_tty || g.pty_binary) && !stdin_eof && g.opt.exec_fd < 0) {
             FD_SET(STDIN_FILENO, &readfds);
         }
         FD_SET(g.fd_ptym, &readfds);
+        FD_ZERO(&writefds);
+        if (g.exec.state == EXEC_READY) {
+            exec_fill(fd_to_pty);
+            if (! g.exec.eof && g.exec.nline < sizeof(g.exec.line) ) {
+                FD_SET(g.opt.exec_fd, &readfds);
+                if (g.opt.exec_fd > maxfd) {
+                    maxfd = g.opt.exec_fd;
+                }
+            }
+            if (g.exec.npend > 0) {
+                FD_SET(g.fd_ptym, &writefds);
+            }
+        }
+        if (g.share.fd >= 0) {
+            FD_SET(g.share.fd, &readfds);
+            if (g.share.fd > maxfd) {
+                maxfd = g.share.fd;
+            }
+            for (i = 0; i < g.share.nviewers; ++i) {
+                FD_SET(g.share.viewers[i].fd, &readfds);
+                if (g.share.viewers[i].pos < g.share.head) {
+                    FD_SET(g.share.viewers[i].fd, &writefds);
+                }
+                if (g.share.viewers[i].fd > maxfd) {
+                    maxfd = g.share.viewers[i].fd;
+                }
+            }
+        }
 
-        select_timeout.tv_sec = 1;
-        select_timeout.tv_usec = 100 * 1000;
+        /* the next EOF for the child (see above) */
+        if (stdin_eof && wait_ms > 50) {
+            wait_ms = 50;
+        }
+
+        select_timeout.tv_sec = wait_ms / 1000;
+        select_timeout.tv_usec = wait_ms % 1000 * 1000;
 
-        r = select(g.fd_ptym + 1, &readfds, NULL, NULL, &select_timeout);
+        r = select(maxfd + 1, &readfds, &writefds, NULL, &select_timeout);
         if (r == 0) {
             /* timeout */
             continue;
@@ -802,98 +2818,106 @@ L_chk_sigchld:
          */
         if (FD_ISSET(g.fd_ptym, &readfds) ) {
             while (true) {
-                nread = read_if_ready(g.fd_ptym, cache + ncache,
-                    2 * BUFFSIZE - (cache - buf2));
+                nread = read_if_ready(g.fd_ptym, buf2, sizeof(buf2) );
                 if (nread <= 0) {
                     /* child exited? */
                     goto L_chk_sigchld;
                 }
 
-                write2(STDOUT_FILENO, fd_from_pty, cache + ncache, nread);
+                write2(-1, fd_from_pty, buf2, nread);
+                share_output(buf2, nread);
+                if (g.exec.state == EXEC_LOGIN) {
+                    stdout_write(fd_stdout, buf2, nread);
+                } else {
+                    exec_scan(buf2, nread);
+                }
 
-                if (! given_up && g.opt.timeout != 0
-                    && labs(time(NULL) - last_time) >= g.opt.timeout) {
-                    given_up = true;
+                now = now_ms();
+                act = proto_output(p, buf2, nread, now);
+                if (act & ACT_FATAL) {
+                    fatal(p->rcode, "%s", p->msg);
                 }
+                if (act & ACT_YESNO) {
+                    char *yes = "yes\r";
 
-                /* regexec() does not like NULLs */
-                if (! given_up) {
-                    for (i = 0; i < nread; ++i) {
-                        if (cache[ncache + i] == 0) {
-                            cache[ncache + i] = 0xff;
-                        }
-                    }
+                    write2(g.fd_ptym, fd_to_pty, yes, strlen(yes) );
+                    stat_publish(&p->pc, 0, strlen(yes), now);
                 }
-                ncache += nread;
-                /* make it NULL-terminated so regexec() would be happy */
-                cache[ncache] = 0;
-
-                /* match password prompt and send the password */
-                if (! g.now_interactive && ! given_up) {
-                    if (g.opt.auto_yesno && passwords_seen == 0
-                        && regexec(&g.opt.re_yesno, cache, 1, re_match, 0) == 0)
-                    {
-                        /*
-                         * (yes/no)?
-                         */
-                        char *yes = "yes\r";
-
-                        write2(g.fd_ptym, fd_to_pty, yes, strlen(yes) );
-
-                        ncache -= re_match[0].rm_eo;
-                        cache += re_match[0].rm_eo;
-                    } else if (regexec(&g.opt.re_prompt, cache, 1, re_match, 0) == 0) {
-                        /*
-                         * Password:
-                         */
-
-                        ++passwords_seen;
-
-                        last_time = time(NULL);
-
-                        if (g.opt.fatal_more_tries) {
-                            if (g.opt.tries != 0 && passwords_seen > g.opt.tries) {
-                                fatal(ERROR_MAX_TRIES, "still prompted for passwords after %d tries", g.opt.tries);
-                            }
-                        } else if (g.opt.tries != 0 && passwords_seen >= g.opt.tries) {
-                            given_up = true;
-                        }
-
-                        write(g.fd_ptym, g.opt.password, strlen(g.opt.password));
-                        write(g.fd_ptym, "\r", 1);
-
-                        write(fd_to_pty, "********\r", strlen("********\r") );
-
-                        ncache -= re_match[0].rm_eo;
-                        cache += re_match[0].rm_eo;
-                    }
-                } else {
-                    cache = buf2;
-                    ncache = 0;
+                if (act & ACT_READY) {
+                    notify_ready();
+                }
+                if ((act & ACT_FAILED) && g.opt.retries > 0) {
+                    respawn(p, false, fd_stdout, fd_from_pty);
+                    goto L_chk_sigchld;
+                }
+                if (act & ACT_SHELL) {
+                    g.held.prompted = true;
+                    held_release(p, fd_to_pty);
                 }
+                if (act & ACT_PASSWORD) {
+                    write(g.fd_ptym, g.opt.password, strlen(g.opt.password));
+                    write(g.fd_ptym, "\r", 1);
 
-                if (cache + ncache >= buf2 + 2 * BUFFSIZE) {
-                    if (ncache > BUFFSIZE) {
-                        cache += ncache - BUFFSIZE;
-                        ncache = BUFFSIZE;
-                    }
-                    memmove(buf2, cache, ncache);
-                    cache = buf2;
+                    write(fd_to_pty, "********\r", strlen("********\r") );
+                    stat_publish(&p->pc, 0, strlen(g.opt.password) + 1, now);
                 }
+
+                stat_publish(&p->pc, nread, 0, now);
             }
         }
         /*
          * copy data from stdin to ptym
          */
-        if (!stdin_eof && FD_ISSET(STDIN_FILENO, &readfds) ) {
+        if (g.opt.shell_prompt != NULL && FD_ISSET(STDIN_FILENO, &readfds) ) {
+            /* `-q': not before the shell prompts */
+            nread = read(STDIN_FILENO, g.held.buf + g.held.n,
+                sizeof(g.held.buf) - g.held.n);
+            if (nread < 0) {
+                fatal_sys("read error from stdin");
+            } else if (nread == 0) {
+                g.held.eof = true;
+            }
+            g.held.n += nread;
+            held_release(p, fd_to_pty);
+        } else if (!stdin_eof && g.opt.exec_fd < 0 && FD_ISSET(STDIN_FILENO, &readfds) ) {
             if ((nread = read(STDIN_FILENO, buf1, BUFFSIZE)) < 0)
                 fatal_sys("read error from stdin");
             else if (nread == 0) {
                 /* EOF on stdin means we're done */
                 stdin_eof = true;
             } else {
-                g.now_interactive = true;
+                proto_input(p);
                 write2(g.fd_ptym, fd_to_pty, buf1, nread);
+                stat_publish(&p->pc, 0, nread, now_ms() );
+            }
+        }
+        /*
+         * `-x': commands to run
+         */
+        if (g.exec.state == EXEC_READY) {
+            if (! g.exec.eof && FD_ISSET(g.opt.exec_fd, &readfds) ) {
+                exec_read(fd_to_pty);
+            }
+            if (FD_ISSET(g.fd_ptym, &writefds) ) {
+                exec_flush();
+            }
+        }
+        /*
+         * `-s': viewers
+         */
+        if (g.share.fd >= 0) {
+            for (i = g.share.nviewers - 1; i >= 0; --i) {
+                int fd = g.share.viewers[i].fd;
+
+                if (FD_ISSET(fd, &readfds) && ! share_read(i, p, fd_to_pty) ) {
+                    continue;
+                }
+                if (FD_ISSET(fd, &writefds) ) {
+                    share_flush(i);
+                }
+            }
+            if (FD_ISSET(g.share.fd, &readfds) ) {
+                share_accept();
             }
         }
     }
@@ -902,7 +2926,19 @@ L_done:
     /* the child has exited but there may be still some data for us
      * to read */
     while ((nread = read_if_ready(g.fd_ptym, buf2, BUFFSIZE) ) > 0) {
-        write2(STDOUT_FILENO, fd_from_pty, buf2, nread);
+        write2(-1, fd_from_pty, buf2, nread);
+        share_output(buf2, nread);
+        if (g.exec.state == EXEC_LOGIN) {
+            stdout_write(fd_stdout, buf2, nread);
+        } else {
+            exec_scan(buf2, nread);
+        }
+        stat_publish(&p->pc, nread, 0, now_ms() );
+    }
+    share_drain(1000);
+    if (g.opt.tag != NULL && fd_stdout >= 0) {
+        /* the last line without a newline */
+        tag_flush(fd_stdout);
     }
 
     if (fd_to_pty >= 0) {
@@ -913,58 +2949,489 @@ L_done:
     }
 
     if (exit_code < 0) {
-        exit(ERROR_GENERAL);
-    } else {
-        exit(exit_code);
+        exit_code = ERROR_GENERAL;
     }
+    capture_dump(exit_code);
+    exit(exit_code);
 }
 
-int
-main(int argc, char *argv[])
+/*
+ * `-a': the absolute path of passh, for $SSH_ASKPASS.
+ */
+char *
+askpass_self(const char *argv0)
 {
-    char slave_name[32];
-    pid_t pid;
-    struct termios orig_termios;
-    struct winsize size;
+    static char path[PATH_MAX];
+    char try[PATH_MAX], *env, *dir;
+    ssize_t n;
 
-    startup();
+    if ((n = readlink("/proc/self/exe", path, sizeof(path) - 1) ) > 0) {
+        path[n] = '\0';
+        return path;
+    }
+    if (strchr(argv0, '/') != NULL) {
+        return realpath(argv0, path);
+    }
+    if ((env = getenv("PATH") ) == NULL || (env = strdup(env) ) == NULL) {
+        return NULL;
+    }
+    for (dir = strtok(env, ":"); dir != NULL; dir = strtok(NULL, ":") ) {
+        snprintf(try, sizeof(try), "%s/%s", dir, argv0);
+        if (access(try, X_OK) == 0) {
+            free(env);
+            return realpath(try, path);
+        }
+    }
+    free(env);
+    return NULL;
+}
 
-    getargs(argc, argv);
+void
+askpass_atexit(void)
+{
+    /* not in the child */
+    if (g.askpass.pid == getpid() ) {
+        unlink(g.askpass.path);
+        if (g.askpass.link != NULL) {
+            unlink(g.askpass.link);
+        }
+        rmdir(g.askpass.dir);
+    }
+}
 
-    g.stdin_is_tty = isatty(STDIN_FILENO);
+/*
+ * `-a': listen on a socket in a private directory and tell the askpass (passh
+ * run by ssh) where it is and the token it has to show.
+ */
+void
+askpass_open(const char *argv0)
+{
+    struct sockaddr_un sa;
+    unsigned char rnd[16];
+    char *self, *tmp, *slash;
+    char askpass[PATH_MAX], real[PATH_MAX];
+    int fd, i;
+
+    if ((self = askpass_self(argv0) ) == NULL) {
+        fatal(ERROR_GENERAL, "can't find myself for SSH_ASKPASS: %s", argv0);
+    }
 
-    sig_handle(SIGCHLD, sig_child);
+    if ((fd = open("/dev/urandom", O_RDONLY) ) < 0) {
+        fatal_sys("open: /dev/urandom");
+    }
+    if (read(fd, rnd, sizeof(rnd) ) != sizeof(rnd) ) {
+        fatal_sys("read: /dev/urandom");
+    }
+    close(fd);
+    for (i = 0; i < sizeof(rnd); ++i) {
+        sprintf(g.askpass.token + 2 * i, "%02x", rnd[i]);
+    }
 
-    if (g.stdin_is_tty) {
-        if (tcgetattr(STDIN_FILENO, &orig_termios) < 0)
-            fatal_sys("tcgetattr error on stdin");
-        if (ioctl(STDIN_FILENO, TIOCGWINSZ, (char *) &size) < 0)
-            fatal_sys("TIOCGWINSZ error");
+    /* only for us. mkdir() fails if someone has created it already. */
+    tmp = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    if (snprintf(g.askpass.dir, sizeof(g.askpass.dir), "%s/passh.%ld.%.8s", tmp,
+            (long) getpid(), g.askpass.token) >= sizeof(g.askpass.dir) - 5) {
+        fatal(ERROR_GENERAL, "TMPDIR too long: %s", tmp);
+    }
+    if (mkdir(g.askpass.dir, 0700) < 0) {
+        fatal_sys("mkdir: %s", g.askpass.dir);
+    }
+    g.askpass.pid = getpid();
+    if (atexit(askpass_atexit) < 0)
+        fatal_sys("atexit error");
 
-        pid = pty_fork(&g.fd_ptym, slave_name, sizeof(slave_name),
-            &orig_termios, &size);
+    memset(&sa, 0, sizeof(sa) );
+    sa.sun_family = AF_UNIX;
+    sprintf(sa.sun_path, "%s/sock", g.askpass.dir);
+    g.askpass.path = strdup(sa.sun_path);
 
-    } else {
-        pid = pty_fork(&g.fd_ptym, slave_name, sizeof(slave_name),
-            NULL, NULL);
+    if ((g.askpass.fd = socket(AF_UNIX, SOCK_STREAM, 0) ) < 0) {
+        fatal_sys("socket error");
+    }
+    if (bind(g.askpass.fd, (struct sockaddr *) &sa, sizeof(sa) ) < 0) {
+        fatal_sys("bind: %s", sa.sun_path);
+    }
+    if (listen(g.askpass.fd, 4) < 0) {
+        fatal_sys("listen: %s", sa.sun_path);
     }
+    fcntl(g.askpass.fd, F_SETFD, FD_CLOEXEC);
 
-    if (pid < 0) {
+    /*
+     * Only run as `passh-askpass' we're the askpass, not just because the
+     * environment says so (every process under the child inherits it). Use
+     * the link `make' creates next to passh, or make one.
+     */
+    snprintf(askpass, sizeof(askpass), "%s", self);
+    slash = strrchr(askpass, '/');
+    snprintf(slash + 1, sizeof(askpass) - (slash + 1 - askpass), "passh-askpass");
+    if (realpath(askpass, real) == NULL || strcmp(real, self) != 0) {
+        snprintf(askpass, sizeof(askpass), "%s/passh-askpass", g.askpass.dir);
+        if (symlink(self, askpass) < 0) {
+            fatal_sys("symlink: %s", askpass);
+        }
+        g.askpass.link = strdup(askpass);
+    }
+
+    setenv("SSH_ASKPASS", askpass, 1);
+    setenv("SSH_ASKPASS_REQUIRE", "force", 1);
+    setenv(ASKPASS_SOCKET_ENV, sa.sun_path, 1);
+    setenv(ASKPASS_TOKEN_ENV, g.askpass.token, 1);
+}
+
+/*
+ * `-a': one request from the askpass, "<token>\n<prompt>". The answer is
+ * "<password>\n", "yes\n" or nothing (the askpass fails).
+ */
+void
+askpass_answer()
+{
+    char buf[4096];
+    struct timeval tv = { 5, 0 };
+    const char *answer = NULL;
+    char *prompt;
+    size_t len = 0;
+    ssize_t n;
+    int fd;
+
+    if ((fd = accept(g.askpass.fd, NULL, NULL) ) < 0) {
+        return;
+    }
+    /* a stuck askpass must not hang us */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+    while (len < sizeof(buf) - 1
+           && (n = read(fd, buf + len, sizeof(buf) - 1 - len) ) > 0) {
+        len += n;
+    }
+    buf[len] = '\0';
+
+    prompt = strchr(buf, '\n');
+    if (prompt == NULL || prompt - buf != strlen(g.askpass.token)
+        || memcmp(buf, g.askpass.token, prompt - buf) != 0) {
+        close(fd);
+        return;
+    }
+    ++prompt;
+
+    if (g.opt.auto_yesno && regexec(&g.opt.re_yesno, prompt, 0, NULL, 0) == 0) {
+        answer = "yes";
+    } else if (regexec(&g.opt.re_prompt, prompt, 0, NULL, 0) == 0) {
+        ++g.askpass.passwords_seen;
+        if (g.opt.tries == 0 || g.askpass.passwords_seen <= g.opt.tries) {
+            answer = g.opt.password;
+        } else if (g.opt.fatal_more_tries) {
+            close(fd);
+            kill(g.child_pid, SIGTERM);
+            fatal(ERROR_MAX_TRIES, "still prompted for passwords after %d tries",
+                g.opt.tries);
+        }
+    }
+
+    if (answer != NULL) {
+        writen(fd, answer, strlen(answer) );
+        writen(fd, "\n", 1);
+    }
+    close(fd);
+}
+
+/*
+ * `-a': run the command on our own stdin/stdout/stderr and only answer the
+ * askpass requests. Does not return.
+ */
+void
+askpass_run(const char *argv0)
+{
+    sigset_t chld, omask;
+    int status, r;
+    pid_t pid;
+    fd_set readfds;
+
+    askpass_open(argv0);
+
+    /* SIGCHLD is only delivered in pselect() so it can't be missed */
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &omask);
+    sig_handle(SIGCHLD, sig_child);
+
+    if ((pid = fork() ) < 0) {
         fatal_sys("fork error");
     } else if (pid == 0) {
-        /*
-         * child
-         */
+        sigprocmask(SIG_SETMASK, &omask, NULL);
         if (g.opt.nohup_child) {
             sig_handle(SIGHUP, SIG_IGN);
         }
         if (execvp(g.opt.command[0], g.opt.command) < 0)
             fatal_sys("can't execute: %s", g.opt.command[0]);
     }
+    g.child_pid = pid;
 
-    /*
-     * parent
-     */
+    /* like system(): ^C is for the child, we exit when it does */
+    sig_handle(SIGINT, SIG_IGN);
+    sig_handle(SIGQUIT, SIG_IGN);
+
+    while (true) {
+        if (g.SIGCHLDed) {
+            g.SIGCHLDed = false;
+            if (waitpid(pid, &status, WNOHANG) == pid) {
+                if (WIFEXITED(status) ) {
+                    exit(WEXITSTATUS(status) );
+                }
+                exit(status + 128);
+            }
+        }
+
+        FD_ZERO(&readfds);
+        FD_SET(g.askpass.fd, &readfds);
+        r = pselect(g.askpass.fd + 1, &readfds, NULL, NULL, NULL, &omask);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fatal_sys("select error");
+        }
+        if (FD_ISSET(g.askpass.fd, &readfds) ) {
+            askpass_answer();
+        }
+    }
+}
+
+/*
+ * Run by ssh as $SSH_ASKPASS with the prompt as the argument. Ask the passh
+ * which started ssh and print its answer.
+ */
+int
+askpass_client(const char *prompt)
+{
+    struct sockaddr_un sa;
+    char buf[4096];
+    const char *path = getenv(ASKPASS_SOCKET_ENV);
+    const char *token = getenv(ASKPASS_TOKEN_ENV);
+    size_t len = 0;
+    ssize_t n;
+    int fd;
+
+    if (path == NULL || token == NULL) {
+        fatal(ERROR_USAGE, "Error: only for `passh -a'");
+    }
+    if (strlen(path) >= sizeof(sa.sun_path) ) {
+        return 1;
+    }
+    memset(&sa, 0, sizeof(sa) );
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0) ) < 0
+        || connect(fd, (struct sockaddr *) &sa, sizeof(sa) ) < 0) {
+        fatal_sys("connect: %s", path);
+    }
+
+    writen(fd, token, strlen(token) );
+    writen(fd, "\n", 1);
+    writen(fd, prompt, strlen(prompt) );
+    shutdown(fd, SHUT_WR);
+
+    while (len < sizeof(buf) && (n = read(fd, buf + len, sizeof(buf) - len) ) > 0) {
+        len += n;
+    }
+    close(fd);
+    if (len == 0) {
+        return 1;
+    }
+    writen(STDOUT_FILENO, buf, len);
+    return 0;
+}
+
+/*
+ * Read one `-m' file. Returns false if it's not (yet) valid or the passh
+ * process has gone.
+ */
+bool
+top_read(const char *path, struct passh_stat *out)
+{
+    struct passh_stat *st;
+    struct stat sb;
+    uint32_t seq;
+    int fd, tries;
+    bool ok = false;
+
+    if ((fd = open(path, O_RDONLY) ) < 0) {
+        return false;
+    }
+    if (fstat(fd, &sb) < 0 || sb.st_size != sizeof(*st) ) {
+        close(fd);
+        return false;
+    }
+    st = mmap(NULL, sizeof(*st), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (st == MAP_FAILED) {
+        return false;
+    }
+
+    for (tries = 0; tries < 1000 && ! ok; ++tries) {
+        seq = st->seq;
+        if (seq & 1) {
+            continue;
+        }
+        mem_barrier();
+        memcpy(out, st, sizeof(*out) );
+        mem_barrier();
+        ok = (st->seq == seq);
+    }
+    munmap(st, sizeof(*st) );
+
+    if (! ok || out->magic != STAT_MAGIC || out->version != STAT_VERSION
+        || out->phase > STAT_SESSION) {
+        return false;
+    }
+    /* killed before it could remove the file? */
+    if (kill(out->pid, 0) < 0 && errno == ESRCH) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * passh-top <dir> [<interval>]
+ *
+ * Show the sessions published with `-m <dir>'. With <interval> (seconds),
+ * refresh forever and also show the throughput.
+ */
+int
+passh_top(int argc, char **argv)
+{
+    struct passh_stat st, *prev = NULL, *cur = NULL;
+    int nprev = 0, ncur = 0, i, j;
+    long interval = 0;
+    long long now, last = 0;
+    DIR *dir;
+    struct dirent *ent;
+    char path[1024];
+    int nphase[STAT_SESSION + 1];
+    uint64_t total_in, total_out;
+
+    if (argc < 2 || argc > 3) {
+        printf("Usage: %s <dir> [<interval>]\n", argv[0]);
+        exit(ERROR_USAGE);
+    }
+    if (argc == 3) {
+        interval = arg2ms(argv[2], 'i');
+    }
+
+    while (true) {
+        if ((dir = opendir(argv[1]) ) == NULL) {
+            fatal_sys("opendir: %s", argv[1]);
+        }
+        now = now_ms();
+        ncur = 0;
+        while ((ent = readdir(dir) ) != NULL) {
+            if (strncmp(ent->d_name, "passh.", 6) != 0) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s", argv[1], ent->d_name);
+            if (! top_read(path, &st) ) {
+                continue;
+            }
+            cur = realloc(cur, (ncur + 1) * sizeof(*cur) );
+            if (cur == NULL) {
+                fatal_sys("realloc");
+            }
+            cur[ncur++] = st;
+        }
+        closedir(dir);
+
+        if (interval != 0) {
+            printf("\033[H\033[2J");
+        }
+        printf("%-8s %-8s %-8s %3s %3s %12s %12s %10s %8s %8s  %s\n",
+            "PID", "CHILD", "PHASE", "TRY", "PW", "IN", "OUT", "IN/s", "IDLE", "AGE",
+            "COMMAND");
+
+        memset(nphase, 0, sizeof(nphase) );
+        total_in = total_out = 0;
+        for (i = 0; i < ncur; ++i) {
+            double rate = 0;
+
+            for (j = 0; j < nprev && last != 0; ++j) {
+                if (prev[j].pid == cur[i].pid) {
+                    rate = (cur[i].bytes_in - prev[j].bytes_in) * 1000.0
+                        / (now - last);
+                    break;
+                }
+            }
+            printf("%-8d %-8d %-8s %3d %3d %12llu %12llu %10.0f %8.1f %8.1f  %s\n",
+                cur[i].pid, cur[i].child_pid, stat_names[cur[i].phase],
+                cur[i].attempts, cur[i].passwords_seen,
+                (unsigned long long) cur[i].bytes_in,
+                (unsigned long long) cur[i].bytes_out, rate,
+                (now - cur[i].last_activity_ms) / 1000.0,
+                (now - cur[i].start_ms) / 1000.0, cur[i].command);
+
+            ++nphase[cur[i].phase];
+            total_in += cur[i].bytes_in;
+            total_out += cur[i].bytes_out;
+        }
+        printf("%d sessions:", ncur);
+        for (i = 0; i <= STAT_SESSION; ++i) {
+            printf(" %d %s%s", nphase[i], stat_names[i], i < STAT_SESSION ? "," : "");
+        }
+        printf("; %llu bytes in, %llu bytes out\n",
+            (unsigned long long) total_in, (unsigned long long) total_out);
+        fflush(stdout);
+
+        if (interval == 0) {
+            break;
+        }
+
+        free(prev);
+        prev = cur;
+        nprev = ncur;
+        cur = NULL;
+        last = now;
+        sleep_ms(interval);
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char *name;
+
+    /* passh-top is a link to passh */
+    name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+    if (strcmp(name, "passh-top") == 0) {
+        g.progname = name;
+        return passh_top(argc, argv);
+    }
+    /* ssh running us as its askpass (`-a') */
+    if (strcmp(name, "passh-askpass") == 0) {
+        g.progname = name;
+        return askpass_client(argc >= 2 ? argv[1] : "");
+    }
+
+    startup();
+
+    getargs(argc, argv);
+
+    if (g.opt.askpass) {
+        askpass_run(argv[0]);
+    }
+    if (g.opt.background) {
+        go_background();
+    }
+
+    g.stdin_is_tty = isatty(STDIN_FILENO);
+
+    sig_handle(SIGCHLD, sig_child);
+
+    g.child_pid = spawn();
+
+    if (g.opt.stat_dir != NULL) {
+        stat_open(g.opt.command);
+    }
+    if (g.opt.share_path != NULL) {
+        share_open();
+    }
 
     /* stdout also needs to be checked. Or `passh ls -l | less' would not
      * restore the saved tty settings. */